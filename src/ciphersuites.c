@@ -64,6 +64,11 @@ struct _ntbtls_ciphersuite_s
  */
 static const int ciphersuite_preference[] = {
 
+  /* The TLS 1.3 suites */
+  TLS_AES_256_GCM_SHA384,
+  TLS_CHACHA20_POLY1305_SHA256,
+  TLS_AES_128_GCM_SHA256,
+
   /* All AES-256 ephemeral suites */
   TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
   TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
@@ -79,6 +84,11 @@ static const int ciphersuite_preference[] = {
   TLS_ECDHE_ECDSA_WITH_AES_256_CCM_8,
   TLS_DHE_RSA_WITH_AES_256_CCM_8,
 
+  /* All ChaCha20-Poly1305 ephemeral suites */
+  TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+  TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+  TLS_DHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+
   /* All CAMELLIA-256 ephemeral suites */
   TLS_ECDHE_ECDSA_WITH_CAMELLIA_256_GCM_SHA384,
   TLS_ECDHE_RSA_WITH_CAMELLIA_256_GCM_SHA384,
@@ -118,6 +128,8 @@ static const int ciphersuite_preference[] = {
   TLS_DHE_RSA_WITH_3DES_EDE_CBC_SHA,
 
   /* The PSK ephemeral suites */
+  TLS_ECDHE_PSK_WITH_CHACHA20_POLY1305_SHA256,
+  TLS_DHE_PSK_WITH_CHACHA20_POLY1305_SHA256,
   TLS_DHE_PSK_WITH_AES_256_GCM_SHA384,
   TLS_DHE_PSK_WITH_AES_256_CCM,
   TLS_ECDHE_PSK_WITH_AES_256_CBC_SHA384,
@@ -193,6 +205,7 @@ static const int ciphersuite_preference[] = {
   TLS_ECDH_ECDSA_WITH_3DES_EDE_CBC_SHA,
 
   /* The RSA PSK suites */
+  TLS_RSA_PSK_WITH_CHACHA20_POLY1305_SHA256,
   TLS_RSA_PSK_WITH_AES_256_GCM_SHA384,
   TLS_RSA_PSK_WITH_AES_256_CBC_SHA384,
   TLS_RSA_PSK_WITH_AES_256_CBC_SHA,
@@ -208,6 +221,7 @@ static const int ciphersuite_preference[] = {
   TLS_RSA_PSK_WITH_3DES_EDE_CBC_SHA,
 
   /* The PSK suites */
+  TLS_PSK_WITH_CHACHA20_POLY1305_SHA256,
   TLS_PSK_WITH_AES_256_GCM_SHA384,
   TLS_PSK_WITH_AES_256_CCM,
   TLS_PSK_WITH_AES_256_CBC_SHA384,
@@ -233,6 +247,31 @@ static const int ciphersuite_preference[] = {
 
 static const struct _ntbtls_ciphersuite_s ciphersuite_definitions[] = {
 
+  /* For TLS 1.3 the MAC is the HMAC used by the key schedule.  */
+  {TLS_AES_128_GCM_SHA256,
+   "TLS-AES-128-GCM-SHA256",
+   GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_GCM, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_NONE,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_4,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_4},
+
+  {TLS_AES_256_GCM_SHA384,
+   "TLS-AES-256-GCM-SHA384",
+   GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, GCRY_MAC_HMAC_SHA384,
+   KEY_EXCHANGE_NONE,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_4,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_4},
+
+  {TLS_CHACHA20_POLY1305_SHA256,
+   "TLS-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_NONE,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_4,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_4},
+
   {TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA,
    "TLS-ECDHE-ECDSA-WITH-AES-128-CBC-SHA",
    GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CBC, GCRY_MAC_HMAC_SHA1,
@@ -1274,47 +1313,190 @@ static const struct _ntbtls_ciphersuite_s ciphersuite_definitions[] = {
    TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_0,
    TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
 
+  {TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+   "TLS-ECDHE-RSA-WITH-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_ECDHE_RSA,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
+
+  {TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+   "TLS-ECDHE-ECDSA-WITH-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_ECDHE_ECDSA,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
+
+  {TLS_DHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+   "TLS-DHE-RSA-WITH-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_DHE_RSA,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
+
+  {TLS_PSK_WITH_CHACHA20_POLY1305_SHA256,
+   "TLS-PSK-WITH-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_PSK,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
+
+  {TLS_ECDHE_PSK_WITH_CHACHA20_POLY1305_SHA256,
+   "TLS-ECDHE-PSK-WITH-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_ECDHE_PSK,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
+
+  {TLS_DHE_PSK_WITH_CHACHA20_POLY1305_SHA256,
+   "TLS-DHE-PSK-WITH-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_DHE_PSK,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
+
+  {TLS_RSA_PSK_WITH_CHACHA20_POLY1305_SHA256,
+   "TLS-RSA-PSK-WITH-CHACHA20-POLY1305-SHA256",
+   GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, GCRY_MAC_HMAC_SHA256,
+   KEY_EXCHANGE_RSA_PSK,
+   0,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3,
+   TLS_MAJOR_VERSION_3, TLS_MINOR_VERSION_3},
+
   {0, "", 0, 0, 0, 0, 0, 0, 0, 0}
 };
 
 
+/* The list of suites supported by this build and the Libgcrypt in
+ * use, in order of preference.  This and SUITE_INDEX are filled once
+ * by _ntbtls_ciphersuite_init and are not modified afterwards.  */
 static int supported_ciphersuites[DIM (ciphersuite_definitions)];
-static int supported_init = 0;
 
+/* Lock and flag to run _ntbtls_ciphersuite_init only once.  The flag
+ * is set with release semantics after the tables have been filled so
+ * that a reader which sees it set with an acquire load can skip the
+ * lock.  */
+GPGRT_LOCK_DEFINE (suites_init_lock);
+static int suites_initialized;
 
-/* Return an array with all supported cipher suites.  */
-const int *
-_ntbtls_ciphersuite_list (void)
+
+/* An index to map a suite id to its entry in ciphersuite_definitions.
+ * The ids are grouped into pages by their high byte; the low byte is
+ * used as index into the page.  An entry holds the index into
+ * ciphersuite_definitions plus one or 0 for an unknown suite.  */
+#define INDEX_NPAGES 4
+static unsigned char suite_index[INDEX_NPAGES][256];
+
+
+/* Return the page of SUITE_INDEX for SUITE_ID or -1 if there is
+ * none.  */
+static int
+suite_index_page (int suite_id)
 {
-  /*
-   * On initial call filter out all ciphersuites not supported by current
-   * build based on presence in the ciphersuite_definitions.
-   */
-  //FIXME: We need to check that algorithms are enabled in libgcrypt
-  //       and we need to protect this with a mutex.
-  if (!supported_init)
+  switch ((suite_id >> 8))
     {
-      ciphersuite_t suite;
-      int i, j;
+    case 0x00: return 0;
+    case 0xC0: return 1;
+    case 0xCC: return 2;
+    case 0x13: return 3;
+    default:   return -1;
+    }
+}
+
+
+static void
+build_suite_index (void)
+{
+  int i, page;
 
-      for (i=j=0; (ciphersuite_preference[i]
-                   && j < DIM(ciphersuite_definitions)-1); i++)
+  for (i = 0; ciphersuite_definitions[i].tlsid; i++)
+    {
+      page = suite_index_page (ciphersuite_definitions[i].tlsid);
+      if (page < 0 || i + 1 > 255)
         {
-          if ((suite = _ntbtls_ciphersuite_from_id (ciphersuite_preference[i])))
-            {
-              /*FIXME: CCM are not yet ready for us - disable.  */
-              if (suite->ciphermode != GCRY_CIPHER_MODE_CCM
-                  && suite->key_exchange != KEY_EXCHANGE_ECDH_RSA
-                  && suite->key_exchange != KEY_EXCHANGE_ECDHE_ECDSA
-                  && suite->key_exchange != KEY_EXCHANGE_ECDH_ECDSA)
-                supported_ciphersuites[j++] = ciphersuite_preference[i];
-            }
+          debug_bug ();
+          continue;
         }
-      supported_ciphersuites[j] = 0;
+      suite_index[page][ciphersuite_definitions[i].tlsid & 0xff] = i + 1;
+    }
+}
+
+
+/* Return true if the algorithms used by SUITE are available in
+ * Libgcrypt.  gcry_cipher_test_algo does not tell whether the cipher
+ * mode is supported (e.g. CCM or Poly1305 in an older Libgcrypt);
+ * thus we also try to open a handle for the combination.  */
+static int
+suite_algos_available (ciphersuite_t suite)
+{
+  gcry_cipher_hd_t hd;
+
+  if (gcry_cipher_test_algo (suite->cipher))
+    return 0;
+  if (gcry_cipher_open (&hd, suite->cipher, suite->ciphermode, 0))
+    return 0;
+  gcry_cipher_close (hd);
+  if (gcry_mac_test_algo (suite->mac))
+    return 0;
+  return 1;
+}
 
-      supported_init = 1;
+
+/* Build the tables describing the supported ciphersuites.  This is
+ * called by ntbtls_check_version and again by ntbtls_new; only the
+ * first call does any work.  Because all lookups are done on behalf
+ * of a context the tables are immutable once they are used.  */
+void
+_ntbtls_ciphersuite_init (void)
+{
+  ciphersuite_t suite;
+  int i, j;
+
+  if (__atomic_load_n (&suites_initialized, __ATOMIC_ACQUIRE))
+    return;
+
+  gpgrt_lock_lock (&suites_init_lock);
+  if (suites_initialized)
+    {
+      gpgrt_lock_unlock (&suites_init_lock);
+      return;
     }
 
+  build_suite_index ();
+
+  /* Filter out all ciphersuites not supported by the current build
+     or by Libgcrypt.  */
+  for (i=j=0; (ciphersuite_preference[i]
+               && j < DIM(ciphersuite_definitions)-1); i++)
+    {
+      if ((suite = _ntbtls_ciphersuite_from_id (ciphersuite_preference[i])))
+        {
+          if (suite->key_exchange != KEY_EXCHANGE_ECDH_RSA
+              && suite->key_exchange != KEY_EXCHANGE_ECDH_ECDSA
+              && suite_algos_available (suite))
+            supported_ciphersuites[j++] = ciphersuite_preference[i];
+        }
+    }
+  supported_ciphersuites[j] = 0;
+
+  __atomic_store_n (&suites_initialized, 1, __ATOMIC_RELEASE);
+  gpgrt_lock_unlock (&suites_init_lock);
+}
+
+
+/* Return an array with all supported cipher suites.  This is called
+ * for each new context and makes sure that the tables are
+ * initialized; after the first call this does not take a lock.  */
+const int *
+_ntbtls_ciphersuite_list (void)
+{
+  _ntbtls_ciphersuite_init ();
   return supported_ciphersuites;
 }
 
@@ -1322,13 +1504,15 @@ _ntbtls_ciphersuite_list (void)
 ciphersuite_t
 _ntbtls_ciphersuite_from_id (int suite_id)
 {
-  ciphersuite_t suite;
-
-  for (suite = ciphersuite_definitions; suite->tlsid; suite++)
-    if (suite->tlsid == suite_id)
-      return suite;
-
-  return NULL;
+  int page, idx;
+
+  if (suite_id < 0 || suite_id > 0xffff)
+    return NULL;
+  page = suite_index_page (suite_id);
+  if (page < 0)
+    return NULL;
+  idx = suite_index[page][suite_id & 0xff];
+  return idx? &ciphersuite_definitions[idx - 1] : NULL;
 }
 
 
@@ -192,8 +192,24 @@
 #define TLS_ECDHE_ECDSA_WITH_AES_128_CCM_8      0xC0AE  /**< TLS 1.2 */
 #define TLS_ECDHE_ECDSA_WITH_AES_256_CCM_8      0xC0AF  /**< TLS 1.2 */
 
+/* RFC 7905 */
+#define TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256   0xCCA8 /**< TLS 1.2 */
+#define TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256 0xCCA9 /**< TLS 1.2 */
+#define TLS_DHE_RSA_WITH_CHACHA20_POLY1305_SHA256     0xCCAA /**< TLS 1.2 */
+#define TLS_PSK_WITH_CHACHA20_POLY1305_SHA256         0xCCAB /**< TLS 1.2 */
+#define TLS_ECDHE_PSK_WITH_CHACHA20_POLY1305_SHA256   0xCCAC /**< TLS 1.2 */
+#define TLS_DHE_PSK_WITH_CHACHA20_POLY1305_SHA256     0xCCAD /**< TLS 1.2 */
+#define TLS_RSA_PSK_WITH_CHACHA20_POLY1305_SHA256     0xCCAE /**< TLS 1.2 */
+
+/* RFC 8446 - The key exchange and authentication are negotiated
+ * separately.  */
+#define TLS_AES_128_GCM_SHA256                  0x1301  /**< TLS 1.3 */
+#define TLS_AES_256_GCM_SHA384                  0x1302  /**< TLS 1.3 */
+#define TLS_CHACHA20_POLY1305_SHA256            0x1303  /**< TLS 1.3 */
+
 #define CIPHERSUITE_FLAG_SHORT_TAG  0x01   /* Short authentication tag.  */
 
+void _ntbtls_ciphersuite_init (void);
 const int *_ntbtls_ciphersuite_list (void);
 ciphersuite_t _ntbtls_ciphersuite_from_id (int suite_id);
 
@@ -52,7 +52,14 @@ typedef enum
     TLS_FLUSH_BUFFERS,
     TLS_HANDSHAKE_WRAPUP,
     TLS_HANDSHAKE_OVER,
-    TLS_SERVER_NEW_SESSION_TICKET
+    TLS_SERVER_NEW_SESSION_TICKET,
+
+    /* The TLS 1.3 handshake reuses the states above where the
+     * messages correspond.  These states are only used by TLS 1.3
+     * and are always set explicitly.  */
+    TLS_ENCRYPTED_EXTENSIONS,
+    TLS_SERVER_CERTIFICATE_VERIFY,
+    TLS_END_OF_EARLY_DATA
 
   } tls_state_t;
 
@@ -131,7 +138,9 @@ struct _ntbtls_session_s
   int compression;              /*!< chosen compression */
   size_t length;                /*!< session id length  */
   unsigned char id[32];         /*!< session identifier */
-  unsigned char master[48];     /*!< the master secret  */
+  unsigned char master[48];     /*!< the master secret or with
+                                     TLS 1.3 the resumption
+                                     master secret */
 
   x509_cert_t peer_chain;       /*!< peer X.509 cert chain */
   int verify_result;            /*!<  verification result     */
@@ -143,11 +152,31 @@ struct _ntbtls_session_s
   unsigned char mfl_code;       /*!< MaxFragmentLength negotiated by peer */
 
   int use_trunc_hmac;           /* Flag for truncated hmac activation.   */
+  int encrypt_then_mac;         /* Flag for encrypt-then-MAC (RFC 7366). */
 };
 
 typedef struct _ntbtls_session_s *session_t;
 
 
+/*
+ * A TLS 1.3 session ticket as kept in the ticket cache.
+ */
+struct _ntbtls_tls13_ticket_s
+{
+  int ciphersuite;              /* The ciphersuite of the session.  */
+  unsigned char psk[48];        /* The resumption PSK.  */
+  time_t received;              /* Time the ticket was received.  */
+  uint32_t lifetime;            /* Lifetime of the ticket in seconds.  */
+  uint32_t age_add;             /* Value to obfuscate the ticket age.  */
+  uint32_t max_early_data;      /* Max. early data or 0 if not allowed.  */
+  x509_cert_t peer_chain;       /* The server's chain of the session.  */
+  size_t ticket_len;            /* The length of TICKET.  */
+  unsigned char ticket[1];      /* The ticket as sent by the server.  */
+};
+
+typedef struct _ntbtls_tls13_ticket_s *tls13_ticket_t;
+
+
 /*
  * This structure is used for storing ciphersuite information
  */
@@ -182,6 +211,17 @@ struct _ntbtls_transform_s
   gcry_cipher_hd_t cipher_ctx_dec; /* Decryption context.     */
   cipher_mode_t    cipher_mode_dec;/* Mode for encryption.    */
 
+  /* TLS 1.3: The traffic secrets the current keys were derived
+     from.  They are required to compute the next keys for a
+     KeyUpdate.  */
+  unsigned char traffic_secret_enc[48];
+  unsigned char traffic_secret_dec[48];
+
+  /* TLS 1.2 with NTBTLS_KTLS: The AEAD keys.  They are kept only
+     until they have been handed over to the kernel.  */
+  unsigned char ktls_key_enc[32];
+  unsigned char ktls_key_dec[32];
+
   /*
    * Session specific compression layer
    */
@@ -232,8 +272,15 @@ struct _ntbtls_handshake_params_s
   /*
    * Checksum contexts
    */
-  gcry_md_hd_t fin_sha256;     /* Checksum of all handshake messages.  */
-  gcry_md_hd_t fin_sha512;     /* Ditto.  */
+  gcry_md_hd_t fin_md;          /* Checksum of all handshake messages.  */
+
+  /* Until the ciphersuite and thus the hash algorithm for FIN_MD is
+     known the handshake messages are collected in this buffer.  */
+  unsigned char *early_msgs;
+  size_t early_msgs_len;
+  size_t early_msgs_size;
+  gpg_error_t early_msgs_err;   /* Set if the buffer could not be
+                                   enlarged.  */
 
   void (*update_checksum) (ntbtls_t, const unsigned char *, size_t);
   void (*calc_verify) (ntbtls_t, unsigned char *);
@@ -253,6 +300,30 @@ struct _ntbtls_handshake_params_s
   int cli_exts;                 /*!< client extension presence */
 
   int new_session_ticket;       /*!< use NewSessionTicket?    */
+
+  /*
+   * TLS 1.3 key schedule (RFC 8446 section 7.1).  SECRET is the
+   * current stage secret, that is the handshake secret and then the
+   * master secret.  The handshake traffic secrets are kept for the
+   * Finished messages and the client's application traffic secret
+   * until our Finished has been sent.
+   */
+  unsigned char tls13_secret[48];
+  unsigned char tls13_cli_hs_secret[48];
+  unsigned char tls13_srv_hs_secret[48];
+  unsigned char tls13_cli_ap_secret[48];
+
+  unsigned int key_share_group; /* The group of our key share.  */
+  int hello_retry;              /* A HelloRetryRequest was received.  */
+  unsigned char *cookie;        /* Cookie from the HelloRetryRequest */
+  size_t cookie_len;            /* (malloced).  */
+  tls13_ticket_t psk_ticket;    /* The ticket offered for resumption.  */
+  int psk_accepted;             /* The server accepted PSK_TICKET.  */
+  int early_data_sent;          /* Early data was sent after the
+                                   ClientHello.  */
+  int early_data_accepted;      /* The server accepted the early data.  */
+  int false_start;              /* Application data may be sent before
+                                   the server's Finished (RFC 7918).  */
 };
 
 typedef struct _ntbtls_handshake_params_s *handshake_params_t;
@@ -282,6 +353,19 @@ typedef struct _ntbtls_ticket_keys_s *ticket_keys_t;
 
 /*
  * The TLS context object.
+ *
+ * After the handshake has completed the memory used by a connection
+ * is this object (832 bytes on x86_64), the active session (152
+ * bytes) and transform (512 bytes) objects, and the two record
+ * buffers of TLS_BUFFER_LEN (17741) bytes each; that is 36978 bytes
+ * in total.  These figures are checked at compile time in
+ * protocol.c; update both places when changing the objects.  The
+ * record buffers are smaller if a maximum fragment length has been
+ * negotiated and are not held at all by idle connections if
+ * NTBTLS_LAZYBUFFERS is used.  Not included are the cipher and MAC
+ * handles of Libgcrypt and the peer's certificate chain.  The
+ * handshake parameters, their hash contexts and key exchange data
+ * are released by _ntbtls_handshake_wrapup.
  */
 struct _ntbtls_context_s
 {
@@ -386,6 +470,34 @@ struct _ntbtls_context_s
 
   unsigned char *compress_buf;  /*!<  zlib data buffer        */
   unsigned char mfl_code;       /*!< MaxFragmentLength chosen by us   */
+  size_t buffer_len;            /* Size of each of the record buffers.  */
+  size_t wanted_buffer_len;     /* If not 0 the size the buffers shall be
+                                   resized to once they are idle.  */
+
+  /* With NTBTLS_LAZYBUFFERS the record buffers are released while
+     the connection is idle.  The sequence counters, which live in
+     the first 8 bytes of the buffers, and the offsets of IN_MSG and
+     OUT_MSG are kept here until the buffers are needed again.  */
+  unsigned char saved_in_ctr[8];
+  unsigned char saved_out_ctr[8];
+  size_t saved_in_msg_off;
+  size_t saved_out_msg_off;
+
+  /* The number of bytes at the start of IN_CTR and OUT_CTR which may
+     have been written.  Only these are wiped when the buffers are
+     released.  */
+  size_t in_buf_used;
+  size_t out_buf_used;
+
+  /* A reader waits for the header of the next record in this small
+     buffer before the record buffers are allocated again.  */
+  unsigned char lazy_hdr[5];
+  size_t lazy_hdr_len;
+
+  /* With NTBTLS_KTLS these flags are set once the Linux kernel
+     protects the outbound or inbound records.  */
+  int ktls_tx;
+  int ktls_rx;
 
   /*
    * Layer to the TLS encrypted data
@@ -418,9 +530,10 @@ struct _ntbtls_context_s
   int disable_renegotiation;    /*!<  enable/disable renegotiation   */
   int allow_legacy_renegotiation;       /*!<  allow legacy renegotiation     */
   int renego_max_records;       /*!<  grace period for renegotiation */
-  const int *ciphersuite_list[4];       /*!<  allowed ciphersuites / version */
+  const int *ciphersuite_list[5];       /*!<  allowed ciphersuites / version */
   const /*ecp_group_id*/ void *curve_list;   /*!<  allowed curves        */
   int use_trunc_hmac;           /* Use truncated HMAC flag.   */
+  int use_encrypt_then_mac;     /* Offer encrypt-then-MAC flag. */
   int use_session_tickets;      /* Use session tickets flag.  */
   int ticket_lifetime;          /*!<  session ticket lifetime */
 
@@ -445,7 +558,15 @@ struct _ntbtls_context_s
   const char *alpn_chosen;      /*!<  negotiated protocol                   */
 
   /*
-   * Secure renegotiation
+   * TLS 1.3 early data set by ntbtls_set_early_data.  It is released
+   * once the server accepted it or has been sent after the handshake.
+   */
+  unsigned char *early_data;
+  size_t early_data_len;
+
+  /*
+   * Secure renegotiation.  This is all that needs to survive a
+   * handshake for RFC 5746; the handshake parameters are released.
    */
   int secure_renegotiation;     /*!<  does peer support legacy or
                                    secure renegotiation           */
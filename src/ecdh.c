@@ -36,9 +36,52 @@ struct ecdh_context_s
                             * This also holds the secre D and our
                             * public key Q.  */
   gcry_mpi_point_t Qpeer;  /* The peer's public value  */
+  unsigned int mont_nbytes;/* For Montgomery curves the length of an
+                            * encoded point; 0 for other curves.  */
 };
 
 
+/* An item of the pool of pre-generated ephemeral keys.  */
+struct ecdh_poolkey_s
+{
+  struct ecdh_poolkey_s *next;
+  gcry_mpi_t d;            /* The secret.  */
+  size_t qlen;             /* The length of Q.  */
+  unsigned char q[2*TLS_ECP_MAX_BYTES+1];  /* The encoded public key.  */
+};
+typedef struct ecdh_poolkey_s *ecdh_poolkey_t;
+
+/* The maximum number of keys we keep per curve.  */
+#define ECDH_POOL_MAX 256
+
+/* The curves we support along with the pool of pre-generated
+ * ephemeral keys.  The pool is only filled if the application calls
+ * ntbtls_ecdh_pool_fill, usually from a thread which runs during idle
+ * time.  The handshake then takes a key from here and only falls back
+ * to generating the key inline if the pool for the curve is empty.  */
+static struct
+{
+  unsigned int tlsid;      /* The TLS NamedCurve value.  */
+  const char *curve_name;  /* The Libgcrypt name of the curve.  */
+  unsigned int mont_nbytes;/* See struct ecdh_context_s.  */
+  ecdh_poolkey_t keys;
+  unsigned int nkeys;
+} ecdh_curves[] =
+  {
+    { 29, "Curve25519", 32 },
+    { 30, "X448", 56 },
+    { 23, "secp256r1" },
+    { 24, "secp384r1" },
+    { 25, "secp521r1" },
+    { 26, "brainpoolP256r1" },
+    { 27, "brainpoolP384r1" },
+    { 28, "brainpoolP512r1" }
+  };
+
+/* The lock to protect the pool in ECDH_CURVES.  */
+GPGRT_LOCK_DEFINE (ecdh_pool_lock);
+
+
 
 /* Create a new ECDH context.  */
 gpg_error_t
@@ -70,6 +113,106 @@ _ntbtls_ecdh_release (ecdh_context_t ecdh)
 }
 
 
+/* Select the curve with the TLS NamedCurve value TLSID for ECDH.
+ * Any former state of ECDH is cleared.  */
+gpg_error_t
+_ntbtls_ecdh_set_curve (ecdh_context_t ecdh, unsigned int tlsid)
+{
+  int i;
+
+  if (!ecdh)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  ecdh->curve_name = NULL;
+  ecdh->mont_nbytes = 0;
+  gcry_ctx_release (ecdh->ecctx); ecdh->ecctx = NULL;
+  gcry_mpi_point_release (ecdh->Qpeer); ecdh->Qpeer = NULL;
+
+  for (i=0; i < DIM (ecdh_curves); i++)
+    if (ecdh_curves[i].tlsid == tlsid)
+      {
+        ecdh->curve_name = ecdh_curves[i].curve_name;
+        ecdh->mont_nbytes = ecdh_curves[i].mont_nbytes;
+        break;
+      }
+  if (!ecdh->curve_name)
+    return gpg_error (GPG_ERR_UNKNOWN_CURVE);
+
+  debug_msg (3, "ECDH curve: %s", ecdh->curve_name);
+
+  return gcry_mpi_ec_new (&ecdh->ecctx, NULL, ecdh->curve_name);
+}
+
+
+/* Store the peer's public key given by the body of an ECPoint at
+ * BUF of length BUFLEN in ECDH.  The curve must already have been
+ * set.  */
+gpg_error_t
+_ntbtls_ecdh_read_point (ecdh_context_t ecdh,
+                         const void *_buf, size_t buflen)
+{
+  gpg_error_t err;
+  const unsigned char *buf = _buf;
+  gcry_mpi_t tmpmpi;
+  int i;
+
+  if (!ecdh || !buf)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (!ecdh->curve_name || !ecdh->ecctx)
+    return gpg_error (GPG_ERR_NOT_INITIALIZED);
+  if (!buflen)
+    return gpg_error (GPG_ERR_INV_OBJ);
+
+  gcry_mpi_point_release (ecdh->Qpeer); ecdh->Qpeer = NULL;
+
+  if (ecdh->mont_nbytes)
+    {
+      /* For X25519 and X448 the ECPoint is just the little endian
+       * encoded u-coordinate (RFC 8422, 5.4.1).  */
+      unsigned char tmpbuf[56];
+
+      if (buflen != ecdh->mont_nbytes)
+        return gpg_error (GPG_ERR_INV_OBJ);
+      for (i=0; i < buflen; i++)
+        tmpbuf[i] = buf[buflen - 1 - i];
+      /* RFC 7748: Mask the unused most significant bit for X25519.  */
+      if (buflen == 32)
+        tmpbuf[0] &= 0x7f;
+      err = gcry_mpi_scan (&tmpmpi, GCRYMPI_FMT_USG, tmpbuf, buflen, NULL);
+      wipememory (tmpbuf, sizeof tmpbuf);
+      if (err)
+        return err;
+
+      ecdh->Qpeer = gcry_mpi_point_snatch_set (NULL, tmpmpi, NULL,
+                                               gcry_mpi_set_ui (NULL, 1));
+    }
+  else
+    {
+      tmpmpi = gcry_mpi_set_opaque_copy (NULL, buf, 8*buflen);
+      if (!tmpmpi)
+        return gpg_error_from_syserror ();
+
+      ecdh->Qpeer = gcry_mpi_point_new (0);
+      err = gcry_mpi_ec_decode_point (ecdh->Qpeer, tmpmpi, ecdh->ecctx);
+      gcry_mpi_release (tmpmpi);
+      if (err)
+        {
+          gcry_mpi_point_release (ecdh->Qpeer);
+          ecdh->Qpeer = NULL;
+          return err;
+        }
+    }
+
+  /* Libgcrypt can't print the y-coordinate of a Montgomery point.  */
+  if (ecdh->mont_nbytes)
+    debug_buf (3, "ECDH Qpeer", buf, buflen);
+  else
+    debug_pnt (3, "ECDH Qpeer", ecdh->Qpeer, ecdh->ecctx);
+
+  return 0;
+}
+
+
 /* Parse the TLS ECDHE parameters and store them in ECDH.  DER is the
  * buffer with the params of length DERLEN.  The number of actual
  * parsed bytes is stored at R_NPARSED.  */
@@ -82,7 +225,6 @@ _ntbtls_ecdh_read_params (ecdh_context_t ecdh,
   const unsigned char *derstart = _der;
   const unsigned char *der = _der;
   size_t n;
-  gcry_mpi_t tmpmpi;
 
   if (r_nparsed)
     *r_nparsed = 0;
@@ -90,10 +232,6 @@ _ntbtls_ecdh_read_params (ecdh_context_t ecdh,
   if (!ecdh || !der)
     return gpg_error (GPG_ERR_INV_ARG);
 
-  ecdh->curve_name = NULL;
-  gcry_ctx_release (ecdh->ecctx); ecdh->ecctx = NULL;
-  gcry_mpi_point_release (ecdh->Qpeer); ecdh->Qpeer = NULL;
-
   /* struct {
    *     ECParameters curve_params;
    *     ECPoint      public;
@@ -109,23 +247,11 @@ _ntbtls_ecdh_read_params (ecdh_context_t ecdh,
   der++;
   derlen--;
 
-  switch (buf16_to_uint (der))
-    {
-    case 23: ecdh->curve_name = "secp256r1"; break;
-    case 24: ecdh->curve_name = "secp384r1"; break;
-    case 25: ecdh->curve_name = "secp521r1"; break;
-    case 26: ecdh->curve_name = "brainpoolP256r1"; break;
-    case 27: ecdh->curve_name = "brainpoolP384r1"; break;
-    case 28: ecdh->curve_name = "brainpoolP512r1"; break;
-    default:
-      return gpg_error (GPG_ERR_UNKNOWN_CURVE);
-    }
-  der += 2;
-  derlen -= 2;
-
-  err = gcry_mpi_ec_new (&ecdh->ecctx, NULL, ecdh->curve_name);
+  err = _ntbtls_ecdh_set_curve (ecdh, buf16_to_uint (der));
   if (err)
     return err;
+  der += 2;
+  derlen -= 2;
 
   /* Parse ECPoint.  */
   if (derlen < 2)
@@ -136,68 +262,280 @@ _ntbtls_ecdh_read_params (ecdh_context_t ecdh,
   if (n > derlen)
     return gpg_error (GPG_ERR_TOO_LARGE);
 
-  tmpmpi = gcry_mpi_set_opaque_copy (NULL, der, 8*n);
-  if (!tmpmpi)
-    return gpg_error_from_syserror ();
+  err = _ntbtls_ecdh_read_point (ecdh, der, n);
+  if (err)
+    return err;
   der += n;
   derlen -= n;
 
-  ecdh->Qpeer = gcry_mpi_point_new (0);
-  err = gcry_mpi_ec_decode_point (ecdh->Qpeer, tmpmpi, ecdh->ecctx);
-  gcry_mpi_release (tmpmpi);
-  if (err)
-    {
-      gcry_mpi_point_release (ecdh->Qpeer);
-      ecdh->Qpeer = NULL;
-      return err;
-    }
-
   if (r_nparsed)
     *r_nparsed = (der - derstart);
 
-  debug_msg (3, "ECDH curve: %s", ecdh->curve_name);
-  debug_pnt (3, "ECDH Qpeer", ecdh->Qpeer, ecdh->ecctx);
-
   return 0;
 }
 
 
-/* Generate the secret D with 0 < D < N.  */
+/* Generate the secret D with 0 < D < N.  We take 64 bits more
+ * random than the size of N and reduce this modulo N-1 (FIPS 186-4,
+ * B.4.1).  The bias is thus negligible and, unlike a rejection
+ * sampling loop, we need exactly one draw from the RNG.  For the
+ * Montgomery curves with MONT_NBYTES not 0 we instead clamp a random
+ * value as described in RFC 7748.  */
 static gcry_mpi_t
-gen_d (ecdh_context_t ecdh)
+gen_d (gcry_ctx_t ecctx, unsigned int mont_nbytes)
 {
   unsigned int nbits;
   gcry_mpi_t n, d;
 
-  n = gcry_mpi_ec_get_mpi ("n", ecdh->ecctx, 0);
+  if (mont_nbytes)
+    {
+      /* X25519 uses a 255 bit scalar with a cofactor of 8, X448 a 448
+       * bit scalar with a cofactor of 4.  */
+      nbits = mont_nbytes == 32? 255 : 448;
+      d = gcry_mpi_snew (nbits);
+      gcry_mpi_randomize (d, nbits, GCRY_STRONG_RANDOM);
+      gcry_mpi_set_highbit (d, nbits - 1);
+      gcry_mpi_clear_bit (d, 0);
+      gcry_mpi_clear_bit (d, 1);
+      if (mont_nbytes == 32)
+        gcry_mpi_clear_bit (d, 2);
+      return d;
+    }
+
+  n = gcry_mpi_ec_get_mpi ("n", ecctx, 0);
   if (!n)
     return NULL;
   nbits  = gcry_mpi_get_nbits (n);
-  d = gcry_mpi_snew (nbits);
+  d = gcry_mpi_snew (nbits + 64);
+
+  gcry_mpi_randomize (d, nbits + 64, GCRY_STRONG_RANDOM);
+
+  /* D = (D mod (N-1)) + 1  */
+  gcry_mpi_sub_ui (n, n, 1);
+  gcry_mpi_mod (d, d, n);
+  gcry_mpi_add_ui (d, d, 1);
+
+  gcry_mpi_release (n);
+  return d;
+}
+
+
+/* Store the u-coordinate X as the little endian encoded value of
+ * length NBYTES at BUFFER.  BUFSIZE is the length of BUFFER.  */
+static gpg_error_t
+mont_encode (gcry_mpi_t x, unsigned int nbytes,
+             unsigned char *buffer, size_t bufsize)
+{
+  gpg_error_t err;
+  size_t n, i;
+  unsigned char c;
+
+  if (bufsize < nbytes)
+    return gpg_error (GPG_ERR_BUFFER_TOO_SHORT);
 
-  for (;;)
+  err = gcry_mpi_print (GCRYMPI_FMT_USG, buffer, nbytes, &n, x);
+  if (err)
+    return err;
+  /* Right align the big endian value and then reverse it.  */
+  memmove (buffer + nbytes - n, buffer, n);
+  memset (buffer, 0, nbytes - n);
+  for (i=0; i < nbytes/2; i++)
     {
-      /* FIXME: For the second and further iterations we use too much
-       * random.  It would be better to get just a few bits and use
-       * set/clear_bit to insert that into the D.  Or implement a
-       * suitable gen_d function in libgcrypt. */
-      gcry_mpi_randomize (d, nbits, GCRY_STRONG_RANDOM);
+      c = buffer[i];
+      buffer[i] = buffer[nbytes - 1 - i];
+      buffer[nbytes - 1 - i] = c;
+    }
+
+  return 0;
+}
+
+
+/* Compute the public key from the secret D already stored in ECCTX
+ * and write it as the body of an ECPoint to BUFFER.  BUFSIZE is the
+ * length of BUFFER.  The actual length is stored at R_NBYTES.  */
+static gpg_error_t
+encode_public (gcry_ctx_t ecctx, unsigned int mont_nbytes,
+               unsigned char *buffer, size_t bufsize, size_t *r_nbytes)
+{
+  gpg_error_t err;
+  gcry_mpi_t Q;
 
-      /* Make sure we have the requested number of bits.  The code
-       * looks a bit weird but it is easy to understand if you
-       * consider that mpi_set_highbit clears all higher bits. */
-      if (mpi_test_bit (d, nbits-1))
-        mpi_set_highbit (d, nbits-1);
+  *r_nbytes = 0;
+
+  if (mont_nbytes)
+    {
+      gcry_mpi_t d;
+      gcry_mpi_point_t G, P;
+
+      d = gcry_mpi_ec_get_mpi ("d", ecctx, 0);
+      G = gcry_mpi_ec_get_point ("g", ecctx, 0);
+      if (!d || !G)
+        {
+          gcry_mpi_release (d);
+          gcry_mpi_point_release (G);
+          return gpg_error (GPG_ERR_INTERNAL);
+        }
+      P = gcry_mpi_point_new (0);
+      gcry_mpi_ec_mul (P, d, G, ecctx);
+      gcry_mpi_release (d);
+      gcry_mpi_point_release (G);
+      Q = gcry_mpi_new (0);
+      if (gcry_mpi_ec_get_affine (Q, NULL, P, ecctx))
+        err = gpg_error (GPG_ERR_INTERNAL);
       else
-        mpi_clear_highbit (d, nbits-1);
+        err = mont_encode (Q, mont_nbytes, buffer, bufsize);
+      gcry_mpi_point_release (P);
+      debug_mpi (3, "ECDH Qour ", Q);
+      gcry_mpi_release (Q);
+      if (!err)
+        *r_nbytes = mont_nbytes;
+      return err;
+    }
+
+  /* Note that "q" is computed by the get function and returned in
+   * uncompressed form.  */
+  Q = gcry_mpi_ec_get_mpi ("q", ecctx, 0);
+  if (!Q)
+    return gpg_error (GPG_ERR_INTERNAL);
+  debug_mpi (3, "ECDH Qour ", Q);
+
+  err = gcry_mpi_print (GCRYMPI_FMT_USG, buffer, bufsize, r_nbytes, Q);
+  gcry_mpi_release (Q);
+  return err;
+}
+
+
+/* Take a key for the curve ECDH->CURVE_NAME from the pool.  Returns
+ * NULL if no key is available.  */
+static ecdh_poolkey_t
+pool_get_key (ecdh_context_t ecdh)
+{
+  ecdh_poolkey_t pk = NULL;
+  int i;
 
-      if (mpi_cmp (d, n) < 0        /* check: D < N */
-          && mpi_cmp_ui (d, 0) > 0) /* check: D > 0 */
-        break;	/* okay */
+  gpgrt_lock_lock (&ecdh_pool_lock);
+  for (i=0; i < DIM (ecdh_curves); i++)
+    if (!strcmp (ecdh_curves[i].curve_name, ecdh->curve_name))
+      {
+        pk = ecdh_curves[i].keys;
+        if (pk)
+          {
+            ecdh_curves[i].keys = pk->next;
+            ecdh_curves[i].nkeys--;
+          }
+        break;
+      }
+  gpgrt_lock_unlock (&ecdh_pool_lock);
+
+  return pk;
+}
+
+
+static void
+pool_release_key (ecdh_poolkey_t pk)
+{
+  if (!pk)
+    return;
+  gcry_mpi_release (pk->d);
+  free (pk);
+}
+
+
+/* Generate one key pair for the curve CURVE_NAME and store it at
+ * R_PK.  */
+static gpg_error_t
+pool_new_key (const char *curve_name, unsigned int mont_nbytes,
+              ecdh_poolkey_t *r_pk)
+{
+  gpg_error_t err;
+  gcry_ctx_t ecctx;
+  ecdh_poolkey_t pk;
+
+  *r_pk = NULL;
+
+  err = gcry_mpi_ec_new (&ecctx, NULL, curve_name);
+  if (err)
+    return err;
+
+  pk = calloc (1, sizeof *pk);
+  if (!pk)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
     }
 
-  gcry_mpi_release (n);
-  return d;
+  pk->d = gen_d (ecctx, mont_nbytes);
+  if (!pk->d)
+    {
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
+    }
+  gcry_mpi_ec_set_mpi ("d", pk->d, ecctx);
+  err = encode_public (ecctx, mont_nbytes, pk->q, sizeof pk->q, &pk->qlen);
+  if (err)
+    goto leave;
+
+  *r_pk = pk;
+  pk = NULL;
+
+ leave:
+  pool_release_key (pk);
+  gcry_ctx_release (ecctx);
+  return err;
+}
+
+
+/* Fill the pool for CURVE_NAME with up to COUNT pre-generated keys.
+ * If CURVE_NAME is NULL all supported curves are filled.  The keys
+ * are generated without holding the lock, thus this may be called
+ * from a background thread while handshakes are running.  */
+gpg_error_t
+_ntbtls_ecdh_pool_fill (const char *curve_name, unsigned int count)
+{
+  gpg_error_t err;
+  ecdh_poolkey_t pk;
+  unsigned int nkeys;
+  int i, any = 0;
+
+  if (count > ECDH_POOL_MAX)
+    count = ECDH_POOL_MAX;
+
+  for (i=0; i < DIM (ecdh_curves); i++)
+    {
+      if (curve_name && strcmp (ecdh_curves[i].curve_name, curve_name))
+        continue;
+      any = 1;
+
+      for (;;)
+        {
+          gpgrt_lock_lock (&ecdh_pool_lock);
+          nkeys = ecdh_curves[i].nkeys;
+          gpgrt_lock_unlock (&ecdh_pool_lock);
+          if (nkeys >= count)
+            break;
+
+          err = pool_new_key (ecdh_curves[i].curve_name,
+                              ecdh_curves[i].mont_nbytes, &pk);
+          if (err && !curve_name
+              && gpg_err_code (err) == GPG_ERR_UNKNOWN_CURVE)
+            break;  /* Not supported by this Libgcrypt version.  */
+          if (err)
+            return err;
+
+          gpgrt_lock_lock (&ecdh_pool_lock);
+          if (ecdh_curves[i].nkeys < count)
+            {
+              pk->next = ecdh_curves[i].keys;
+              ecdh_curves[i].keys = pk;
+              ecdh_curves[i].nkeys++;
+              pk = NULL;
+            }
+          gpgrt_lock_unlock (&ecdh_pool_lock);
+          pool_release_key (pk);
+        }
+    }
+
+  return any? 0 : gpg_error (GPG_ERR_UNKNOWN_CURVE);
 }
 
 
@@ -211,50 +549,62 @@ _ntbtls_ecdh_make_public (ecdh_context_t ecdh,
 {
   gpg_error_t err;
   size_t n;
+  ecdh_poolkey_t pk;
 
   if (!ecdh || !outbuf || !r_outbuflen || outbufsize < 2)
     return gpg_error (GPG_ERR_INV_ARG);
 
   *r_outbuflen = 0;
 
-  if (!ecdh->curve_name || !ecdh->ecctx || !ecdh->Qpeer)
+  /* Note that with TLS 1.3 our key share is sent before we know the
+   * peer's key; thus QPEER is not required here.  */
+  if (!ecdh->curve_name || !ecdh->ecctx)
     return gpg_error (GPG_ERR_NOT_INITIALIZED);
 
-  /* Create a secret and store it in the context.  */
-  {
-    gcry_mpi_t d;
-
-    d = gen_d (ecdh);
-    if (!d)
-      return gpg_error (GPG_ERR_INV_OBJ);
-
-    gcry_mpi_ec_set_mpi ("d", d, ecdh->ecctx);
-    debug_mpi (3, "ECDH d    ", d);
-    gcry_mpi_release (d);
-  }
+  /* Create a secret and store it in the context.  If we have a
+   * pre-generated key we use that one.  */
+  pk = pool_get_key (ecdh);
+  if (pk)
+    {
+      debug_msg (3, "ECDH using pre-generated key");
+      gcry_mpi_ec_set_mpi ("d", pk->d, ecdh->ecctx);
+      debug_mpi (3, "ECDH d    ", pk->d);
+    }
+  else
+    {
+      gcry_mpi_t d;
 
-  {
-    gcry_mpi_t Q;
+      d = gen_d (ecdh->ecctx, ecdh->mont_nbytes);
+      if (!d)
+        return gpg_error (GPG_ERR_INV_OBJ);
 
-    /* Note that "q" is computed by the get function and returned in
-     * uncompressed form.  */
-    Q = gcry_mpi_ec_get_mpi ("q", ecdh->ecctx, 0);
-    if (!Q)
-      {
-        return gpg_error (GPG_ERR_INTERNAL);
-      }
-    debug_mpi (3, "ECDH Qour ", Q);
+      gcry_mpi_ec_set_mpi ("d", d, ecdh->ecctx);
+      debug_mpi (3, "ECDH d    ", d);
+      gcry_mpi_release (d);
+    }
 
-    /* Write as an ECPoint, that is prefix it with a one octet length.  */
-    err = gcry_mpi_print (GCRYMPI_FMT_USG, outbuf+1, outbufsize-1, &n, Q);
-    gcry_mpi_release (Q);
-    if (err)
-      return err;
-    if (n > 255)
-      return gpg_error (GPG_ERR_INV_DATA);
-    outbuf[0] = n;
-    n++;
-  }
+  /* Write as an ECPoint, that is prefix it with a one octet length.  */
+  if (pk)
+    {
+      if (pk->qlen > outbufsize - 1)
+        err = gpg_error (GPG_ERR_BUFFER_TOO_SHORT);
+      else
+        {
+          memcpy (outbuf+1, pk->q, pk->qlen);
+          n = pk->qlen;
+          err = 0;
+        }
+      pool_release_key (pk);
+    }
+  else
+    err = encode_public (ecdh->ecctx, ecdh->mont_nbytes,
+                         outbuf+1, outbufsize-1, &n);
+  if (err)
+    return err;
+  if (n > 255)
+    return gpg_error (GPG_ERR_INV_DATA);
+  outbuf[0] = n;
+  n++;
 
   *r_outbuflen = n;
 
@@ -288,9 +638,13 @@ _ntbtls_ecdh_calc_secret (ecdh_context_t ecdh,
    * 2. Compute:  P = d * Q_peer
    * 2. Check that P is not the point at infinity.
    * 3. Copy the x-coordinate of P to the output.
+   *
+   * For X25519 and X448 all inputs are valid (RFC 7748) and instead
+   * of step 1 we check that the result is not all zero.
    */
 
-  if (!gcry_mpi_ec_curve_point (ecdh->Qpeer, ecdh->ecctx))
+  if (!ecdh->mont_nbytes
+      && !gcry_mpi_ec_curve_point (ecdh->Qpeer, ecdh->ecctx))
     {
       err = gpg_error (GPG_ERR_INV_DATA);
       goto leave;
@@ -310,7 +664,41 @@ _ntbtls_ecdh_calc_secret (ecdh_context_t ecdh,
       goto leave;
     }
 
-  err = gcry_mpi_print (GCRYMPI_FMT_USG, outbuf, outbufsize, &n, x);
+  if (ecdh->mont_nbytes)
+    {
+      if (!gcry_mpi_cmp_ui (x, 0))
+        {
+          err = gpg_error (GPG_ERR_INV_DATA);
+          goto leave;
+        }
+      err = mont_encode (x, ecdh->mont_nbytes, outbuf, outbufsize);
+      n = ecdh->mont_nbytes;
+    }
+  else
+    {
+      /* The x-coordinate is converted with FE2OSP (RFC 8422, 5.10
+       * and RFC 8446, 7.4.2); i.e. it has the length of the field
+       * and leading zeroes are not stripped.  */
+      gcry_mpi_t p;
+      size_t nbytes;
+
+      p = gcry_mpi_ec_get_mpi ("p", ecdh->ecctx, 0);
+      nbytes = p? (gcry_mpi_get_nbits (p) + 7) / 8 : 0;
+      gcry_mpi_release (p);
+
+      err = gcry_mpi_print (GCRYMPI_FMT_USG, outbuf, outbufsize, &n, x);
+      if (!err && n < nbytes)
+        {
+          if (nbytes > outbufsize)
+            err = gpg_error (GPG_ERR_BUFFER_TOO_SHORT);
+          else
+            {
+              memmove (outbuf + nbytes - n, outbuf, n);
+              memset (outbuf, 0, nbytes - n);
+              n = nbytes;
+            }
+        }
+    }
   if (err)
     goto leave;
 
@@ -0,0 +1,452 @@
+/* ktls.c - Linux kernel TLS offload
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of NTBTLS
+ *
+ * NTBTLS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NTBTLS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With NTBTLS_KTLS the keys and sequence numbers are handed over to
+ * the kernel after the handshake (see Documentation/networking/tls.rst
+ * of Linux).  The kernel then encrypts and decrypts the records of
+ * the socket and we only pass plaintext and the record type.  This
+ * works only if the transport streams are backed by a TCP socket;
+ * otherwise, or if the kernel lacks support for the cipher, the
+ * records are processed as usual.
+ *
+ * With TLS 1.3 the inbound records are always processed by us: A
+ * kernel which can't change the key of a socket would keep on
+ * decrypting with the old key after a KeyUpdate from the peer and
+ * there is no way to detect this beforehand.  For the outbound
+ * direction we only switch keys on request of the peer and a
+ * failure is reported by setsockopt.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_TLS_H
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sys/sendfile.h>
+# include <linux/tls.h>
+#endif
+
+#include "ntbtls-int.h"
+#include "ciphersuites.h"
+
+#ifdef HAVE_LINUX_TLS_H
+
+#ifndef SOL_TLS
+# define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+# define TCP_ULP 31
+#endif
+
+
+/* The crypto info for all ciphers we support.  */
+union crypto_info_u
+{
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 gcm128;
+  struct tls12_crypto_info_aes_gcm_256 gcm256;
+  struct tls12_crypto_info_aes_ccm_128 ccm128;
+  struct tls12_crypto_info_chacha20_poly1305 chacha;
+};
+
+
+/* Fill in the crypto info variant CI for cipher TYPE.  All variants have
+ * the same fields but with different sizes.  The nonce is built from
+ * the 4 byte salt and the 8 byte IV; with TLS 1.2 the IV is the
+ * explicit nonce, which we take from the sequence number.  */
+#define SET_AEAD_INFO(ci, type, keybuf, ivbuf, seqbuf, is_tls13)     \
+  do {                                                                \
+    (ci)->info.cipher_type = (type);                                  \
+    memcpy ((ci)->key, (keybuf), sizeof (ci)->key);                   \
+    memcpy ((ci)->salt, (ivbuf), sizeof (ci)->salt);                  \
+    memcpy ((ci)->iv, (is_tls13)? (ivbuf) + 4 : (seqbuf),             \
+            sizeof (ci)->iv);                                         \
+    memcpy ((ci)->rec_seq, (seqbuf), sizeof (ci)->rec_seq);           \
+  } while (0)
+
+
+/* Return the file descriptor of the socket for the outbound direction
+ * if OUTBOUND is set or else for the inbound direction.  Returns -1
+ * if the transport is not backed by a file descriptor.  */
+static int
+get_fd (ntbtls_t tls, int outbound)
+{
+  return es_fileno (outbound? tls->outbound : tls->inbound);
+}
+
+
+/* Return true if the kernel is able to take over the records of TLS.  */
+static int
+ktls_usable (ntbtls_t tls)
+{
+  transform_t transform = tls->transform;
+  session_t session = tls->session;
+  cipher_algo_t cipher;
+  cipher_mode_t mode;
+
+  if (!transform || !session)
+    return 0;
+
+  if (tls->minor_ver != TLS_MINOR_VERSION_3
+      && tls->minor_ver != TLS_MINOR_VERSION_4)
+    return 0;
+
+  /* The kernel neither compresses nor limits the record size.  */
+  if (session->compression != TLS_COMPRESS_NULL
+      || session->mfl_code != TLS_MAX_FRAG_LEN_NONE)
+    return 0;
+
+  cipher = _ntbtls_ciphersuite_get_cipher (transform->ciphersuite, &mode);
+  switch (mode)
+    {
+    case GCRY_CIPHER_MODE_GCM:
+      if (cipher != GCRY_CIPHER_AES128 && cipher != GCRY_CIPHER_AES256)
+        return 0;
+      break;
+    case GCRY_CIPHER_MODE_CCM:
+      if (cipher != GCRY_CIPHER_AES128
+          || (_ntbtls_ciphersuite_get_flags (transform->ciphersuite)
+              & CIPHERSUITE_FLAG_SHORT_TAG))
+        return 0;
+      break;
+    case GCRY_CIPHER_MODE_POLY1305:
+      break;
+    default:
+      return 0;
+    }
+
+  return get_fd (tls, 1) != -1 && get_fd (tls, 0) != -1;
+}
+
+
+/* Attach the TLS upper layer protocol to the socket FD.  */
+static gpg_error_t
+attach_ulp (int fd)
+{
+  if (setsockopt (fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls")
+      && errno != EEXIST)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Hand the current key, IV and sequence number for the outbound
+ * direction if OUTBOUND is set or else for the inbound direction
+ * over to the kernel.  This is also used for the outbound direction
+ * after a TLS 1.3 KeyUpdate, which requires a recent kernel.  */
+gpg_error_t
+_ntbtls_ktls_set_key (ntbtls_t tls, int outbound)
+{
+  gpg_error_t err;
+  transform_t transform = tls->transform;
+  union crypto_info_u ci;
+  unsigned char key[32];
+  const unsigned char *iv, *seq;
+  cipher_algo_t cipher;
+  cipher_mode_t mode;
+  int is_tls13 = (tls->minor_ver == TLS_MINOR_VERSION_4);
+  size_t cilen;
+
+  err = _ntbtls_get_traffic_key (tls, outbound, key);
+  if (err)
+    return err;
+
+  iv = outbound? transform->iv_enc : transform->iv_dec;
+  seq = outbound? tls->out_ctr : tls->in_ctr;
+  cipher = _ntbtls_ciphersuite_get_cipher (transform->ciphersuite, &mode);
+
+  memset (&ci, 0, sizeof ci);
+  ci.info.version = is_tls13? TLS_1_3_VERSION : TLS_1_2_VERSION;
+  if (mode == GCRY_CIPHER_MODE_POLY1305)
+    {
+      ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+      memcpy (ci.chacha.key, key, sizeof ci.chacha.key);
+      memcpy (ci.chacha.iv, iv, sizeof ci.chacha.iv);
+      memcpy (ci.chacha.rec_seq, seq, sizeof ci.chacha.rec_seq);
+      cilen = sizeof ci.chacha;
+    }
+  else if (mode == GCRY_CIPHER_MODE_CCM)
+    {
+      SET_AEAD_INFO (&ci.ccm128, TLS_CIPHER_AES_CCM_128,
+                     key, iv, seq, is_tls13);
+      cilen = sizeof ci.ccm128;
+    }
+  else if (cipher == GCRY_CIPHER_AES256)
+    {
+      SET_AEAD_INFO (&ci.gcm256, TLS_CIPHER_AES_GCM_256,
+                     key, iv, seq, is_tls13);
+      cilen = sizeof ci.gcm256;
+    }
+  else
+    {
+      SET_AEAD_INFO (&ci.gcm128, TLS_CIPHER_AES_GCM_128,
+                     key, iv, seq, is_tls13);
+      cilen = sizeof ci.gcm128;
+    }
+  wipememory (key, sizeof key);
+
+  if (setsockopt (get_fd (tls, outbound), SOL_TLS,
+                  outbound? TLS_TX : TLS_RX, &ci, cilen))
+    err = gpg_error_from_syserror ();
+  wipememory (&ci, sizeof ci);
+  if (err)
+    {
+      debug_msg (2, "kernel TLS for %s records failed: %s",
+                 outbound? "outbound" : "inbound", gpg_strerror (err));
+      return err;
+    }
+
+  if (outbound)
+    tls->ktls_tx = 1;
+  else
+    tls->ktls_rx = 1;
+  return 0;
+}
+
+
+/* Try to hand the record protection over to the kernel.  This is
+ * called at the end of the handshake.  A failure is not an error;
+ * the records are then protected by us.  */
+void
+_ntbtls_ktls_start (ntbtls_t tls)
+{
+  transform_t transform = tls->transform;
+
+  if (tls->ktls_tx || tls->ktls_rx || !ktls_usable (tls))
+    goto leave;
+
+  if (attach_ulp (get_fd (tls, 1)) || attach_ulp (get_fd (tls, 0)))
+    {
+      debug_msg (2, "kernel TLS not available: %s", strerror (errno));
+      goto leave;
+    }
+
+  /* All records we wrote must be on the wire and the kernel must see
+   * the next inbound record from its start.  */
+  if (!_ntbtls_flush_output (tls) && !es_fflush (tls->outbound))
+    _ntbtls_ktls_set_key (tls, 1);
+  if (tls->minor_ver != TLS_MINOR_VERSION_4
+      && !tls->in_left && !es_pending (tls->inbound)
+      && !(tls->in_hslen && tls->in_hslen < tls->in_msglen))
+    _ntbtls_ktls_set_key (tls, 0);
+
+  debug_msg (2, "kernel TLS used for%s%s records",
+             tls->ktls_tx? " outbound":"",
+             tls->ktls_rx? " inbound":"");
+
+ leave:
+  if (transform)
+    {
+      wipememory (transform->ktls_key_enc, sizeof transform->ktls_key_enc);
+      wipememory (transform->ktls_key_dec, sizeof transform->ktls_key_dec);
+    }
+}
+
+
+/* Send the record in OUT_MSG via the kernel.  */
+gpg_error_t
+_ntbtls_ktls_write_record (ntbtls_t tls)
+{
+  int fd = get_fd (tls, 1);
+  unsigned char *p = tls->out_msg;
+  size_t len = tls->out_msglen;
+  unsigned char cbuf[CMSG_SPACE (1)];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  ssize_t n;
+
+  debug_msg (3, "output record via kernel: msgtype = %d, msglen = %zu",
+             tls->out_msgtype, len);
+
+  while (len)
+    {
+      iov.iov_base = p;
+      iov.iov_len = len;
+      memset (&msg, 0, sizeof msg);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+
+      /* Other records than application data need to be marked.  */
+      if (tls->out_msgtype != TLS_MSG_APPLICATION_DATA)
+        {
+          msg.msg_control = cbuf;
+          msg.msg_controllen = sizeof cbuf;
+          cmsg = CMSG_FIRSTHDR (&msg);
+          cmsg->cmsg_level = SOL_TLS;
+          cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+          cmsg->cmsg_len = CMSG_LEN (1);
+          *CMSG_DATA (cmsg) = tls->out_msgtype;
+        }
+
+      n = sendmsg (fd, &msg, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return gpg_error_from_syserror ();
+
+      p += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+
+/* Receive the next record via the kernel into IN_MSG.  */
+gpg_error_t
+_ntbtls_ktls_read_record (ntbtls_t tls)
+{
+  int fd = get_fd (tls, 0);
+  unsigned char cbuf[CMSG_SPACE (1)];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  ssize_t n;
+
+  iov.iov_base = tls->in_msg;
+  iov.iov_len = TLS_MAX_CONTENT_LEN;
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof cbuf;
+
+  do
+    n = recvmsg (fd, &msg, 0);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return gpg_error_from_syserror ();
+  if (!n)
+    return gpg_error (GPG_ERR_EOF);
+
+  /* Only records which are not application data come with a type.  */
+  tls->in_msgtype = TLS_MSG_APPLICATION_DATA;
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_TLS
+        && cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+      tls->in_msgtype = *CMSG_DATA (cmsg);
+
+  tls->in_msglen = n;
+  tls->in_left = 0;
+
+  debug_msg (3, "input record via kernel: msgtype = %d, msglen = %zu",
+             tls->in_msgtype, tls->in_msglen);
+
+  return 0;
+}
+
+
+/* Send up to *LEN bytes of the file FD starting at *OFFSET using
+ * sendfile.  The kernel builds the records and encrypts them.  On
+ * return *OFFSET and *LEN are updated to reflect what has been sent.
+ * GPG_ERR_NOT_SUPPORTED is returned if sendfile can't be used for FD;
+ * nothing has been sent in this case.  */
+gpg_error_t
+_ntbtls_ktls_send_file (ntbtls_t tls, int fd,
+                        gpgrt_off_t *offset, size_t *len)
+{
+  int outfd = get_fd (tls, 1);
+  off_t off = *offset;
+  gpg_error_t err = 0;
+  ssize_t n;
+
+  debug_msg (3, "send file via kernel: len = %zu", *len);
+
+  while (*len)
+    {
+      n = sendfile (outfd, fd, &off, *len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          if ((errno == EINVAL || errno == ENOSYS) && off == *offset)
+            err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+          else
+            err = gpg_error_from_syserror ();
+          break;
+        }
+      if (!n)
+        {
+          debug_msg (1, "file too short for send_file");
+          err = gpg_error (GPG_ERR_EOF);
+          break;
+        }
+
+      *len -= n;
+    }
+
+  *offset = off;
+  return err;
+}
+
+
+#else /*!HAVE_LINUX_TLS_H*/
+
+
+void
+_ntbtls_ktls_start (ntbtls_t tls)
+{
+  (void)tls;
+  debug_msg (2, "kernel TLS not supported on this platform");
+}
+
+
+gpg_error_t
+_ntbtls_ktls_set_key (ntbtls_t tls, int outbound)
+{
+  (void)tls;
+  (void)outbound;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+
+gpg_error_t
+_ntbtls_ktls_write_record (ntbtls_t tls)
+{
+  (void)tls;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+
+gpg_error_t
+_ntbtls_ktls_read_record (ntbtls_t tls)
+{
+  (void)tls;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+
+gpg_error_t
+_ntbtls_ktls_send_file (ntbtls_t tls, int fd,
+                        gpgrt_off_t *offset, size_t *len)
+{
+  (void)tls;
+  (void)fd;
+  (void)offset;
+  (void)len;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+#endif /*!HAVE_LINUX_TLS_H*/
@@ -25,7 +25,9 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #ifdef HAVE_W32_SYSTEM
 # define WIN32_LEAN_AND_MEAN
 # ifdef HAVE_WINSOCK2_H
@@ -47,6 +49,11 @@ static int verbose;
 static int errorcount;
 static char *opt_hostname;
 static int opt_head;
+static int opt_resume;
+static int opt_false_start;
+static int opt_ktls;
+static char *opt_send_file;
+static unsigned int opt_max_frag;
 
 
 
@@ -285,16 +292,56 @@ connect_estreams (const char *server, int port,
 
 
 
+/* Send the file NAME using ntbtls_send_file.  */
 static void
-simple_client (const char *server, int port)
+send_file (ntbtls_t tls, const char *name)
+{
+  gpg_error_t err;
+  struct stat st;
+  size_t nwritten;
+  int fd;
+
+  fd = open (name, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st))
+    die ("error opening '%s': %s\n", name, strerror (errno));
+
+  err = ntbtls_send_file (tls, fd, 0, st.st_size, &nwritten);
+  if (err)
+    die ("ntbtls_send_file failed after %lu bytes: %s <%s>\n",
+         (unsigned long)nwritten, gpg_strerror (err), gpg_strsource (err));
+  info ("sent %lu bytes from '%s'", (unsigned long)nwritten, name);
+
+  close (fd);
+}
+
+
+/* Connect to SERVER at PORT and send a simple HTTP request.  If
+ * EARLY is set the request is sent as TLS 1.3 early data.  */
+static void
+simple_client (const char *server, int port, int early)
 {
   gpg_error_t err;
   ntbtls_t tls;
   estream_t inbound, outbound;
   estream_t readfp, writefp;
+  char *request;
   int c;
 
-  err = ntbtls_new (&tls, NTBTLS_CLIENT);
+  request = es_bsprintf ("%s / HTTP/1.0\r\n"
+                         "%s%s%s"
+                         "X-ntbtls: %s\r\n"
+                         "\r\n",
+                         opt_head? "HEAD":"GET",
+                         opt_hostname? "Host: ":"",
+                         opt_hostname? opt_hostname:"",
+                         opt_hostname? "\r\n":"",
+                         ntbtls_check_version (PACKAGE_VERSION));
+  if (!request)
+    die ("out of core\n");
+
+  err = ntbtls_new (&tls, (NTBTLS_CLIENT
+                           | (opt_false_start? NTBTLS_FALSESTART : 0)
+                           | (opt_ktls? NTBTLS_KTLS : 0)));
   if (err)
     die ("ntbtls_init failed: %s <%s>\n",
          gpg_strerror (err), gpg_strsource (err));
@@ -322,32 +369,54 @@ simple_client (const char *server, int port)
              gpg_strerror (err), gpg_strsource (err));
     }
 
-  info ("starting handshake");
-  while ((err = ntbtls_handshake (tls)))
+  if (opt_max_frag)
     {
-      const char *s;
+      err = ntbtls_set_max_fragment_length (tls, opt_max_frag);
+      if (err)
+        die ("ntbtls_set_max_fragment_length failed: %s <%s>\n",
+             gpg_strerror (err), gpg_strsource (err));
+    }
 
-      if ((s = ntbtls_get_last_alert (tls, NULL, NULL)))
-        info ("received alert: %s", s);
-      info ("handshake error: %s <%s>", gpg_strerror (err),gpg_strsource (err));
-      switch (gpg_err_code (err))
+  if (early)
+    {
+      err = ntbtls_set_early_data (tls, request, strlen (request));
+      if (err)
+        die ("ntbtls_set_early_data failed: %s <%s>\n",
+             gpg_strerror (err), gpg_strsource (err));
+    }
+
+  /* With False Start the handshake is run by the first write so
+   * that the request is sent right after our Finished.  */
+  if (!opt_false_start)
+    {
+      info ("starting handshake");
+      while ((err = ntbtls_handshake (tls)))
         {
-        default:
-          break;
+          const char *s;
+
+          if ((s = ntbtls_get_last_alert (tls, NULL, NULL)))
+            info ("received alert: %s", s);
+          info ("handshake error: %s <%s>",
+                gpg_strerror (err), gpg_strsource (err));
+          switch (gpg_err_code (err))
+            {
+            default:
+              break;
+            }
+          die ("handshake failed");
         }
-      die ("handshake failed");
+      info ("handshake done");
     }
-  info ("handshake done");
 
   do
     {
-      es_fprintf (writefp, "%s / HTTP/1.0\r\n", opt_head? "HEAD":"GET");
-      if (opt_hostname)
-        es_fprintf (writefp, "Host: %s\r\n", opt_hostname);
-      es_fprintf (writefp, "X-ntbtls: %s\r\n",
-                  ntbtls_check_version (PACKAGE_VERSION));
-      es_fputs ("\r\n", writefp);
-      es_fflush (writefp);
+      if (!early)
+        {
+          es_fputs (request, writefp);
+          es_fflush (writefp);
+        }
+      if (opt_send_file)
+        send_file (tls, opt_send_file);
       while (/*es_pending (readfp) &&*/ (c = es_fgetc (readfp)) != EOF)
         putchar (c);
     }
@@ -356,6 +425,7 @@ simple_client (const char *server, int port)
   ntbtls_release (tls);
   es_fclose (inbound);
   es_fclose (outbound);
+  es_free (request);
 }
 
 
@@ -389,6 +459,11 @@ main (int argc, char **argv)
                  "  --port N        connect to port N (default is 443)\n"
                  "  --hostname NAME use NAME instead of HOST for SNI\n"
                  "  --head          send a HEAD and not a GET request\n"
+                 "  --resume        connect again using early data\n"
+                 "  --false-start   use TLS False Start\n"
+                 "  --ktls          use the kernel TLS offload\n"
+                 "  --send-file FILE send FILE after the request\n"
+                 "  --max-frag N    ask for records of at most N bytes\n"
                  "\n", stdout);
           return 0;
         }
@@ -440,6 +515,37 @@ main (int argc, char **argv)
           opt_head = 1;
           argc--; argv++;
         }
+      else if (!strcmp (*argv, "--resume"))
+        {
+          opt_resume = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--false-start"))
+        {
+          opt_false_start = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--ktls"))
+        {
+          opt_ktls = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--send-file"))
+        {
+          if (argc < 2)
+            die ("argument missing for option '%s'\n", *argv);
+          argc--; argv++;
+          opt_send_file = *argv;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--max-frag"))
+        {
+          if (argc < 2)
+            die ("argument missing for option '%s'\n", *argv);
+          argc--; argv++;
+          opt_max_frag = atoi (*argv);
+          argc--; argv++;
+        }
       else if (!strncmp (*argv, "--", 2) && (*argv)[2])
         die ("Invalid option '%s'\n", *argv);
     }
@@ -464,6 +570,15 @@ main (int argc, char **argv)
   if (debug_level)
     ntbtls_set_debug (debug_level, NULL, NULL);
 
-  simple_client (host, port);
+  if (opt_resume)
+    {
+      if (ntbtls_set_ticket_cache (4))
+        die ("ntbtls_set_ticket_cache failed\n");
+      simple_client (host, port, 0);
+      info ("resuming session");
+      simple_client (host, port, 1);
+    }
+  else
+    simple_client (host, port, 0);
   return 0;
 }
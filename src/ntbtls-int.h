@@ -38,14 +38,21 @@
 #define TLS_MINOR_VERSION_1             1       /* TLS v1.0 */
 #define TLS_MINOR_VERSION_2             2       /* TLS v1.1 */
 #define TLS_MINOR_VERSION_3             3       /* TLS v1.2 */
+#define TLS_MINOR_VERSION_4             4       /* TLS v1.3 */
 
-/* Define minimum and maximum supported versions.  This is currently
-   TLS v1.2 only but we may support newer versions of TLS as soon as
-   they are standardized. */
+/* Define minimum and maximum supported versions.  This is TLS v1.2
+   and TLS v1.3.  Note that TLS v1.3 is negotiated with the
+   supported_versions extension; the version fields in the record
+   header and the hello messages are frozen at TLS v1.2.  */
 #define TLS_MIN_MAJOR_VERSION           TLS_MAJOR_VERSION_3
 #define TLS_MIN_MINOR_VERSION           TLS_MINOR_VERSION_3
 #define TLS_MAX_MAJOR_VERSION           TLS_MAJOR_VERSION_3
-#define TLS_MAX_MINOR_VERSION           TLS_MINOR_VERSION_3
+#define TLS_MAX_MINOR_VERSION           TLS_MINOR_VERSION_4
+
+/* The minor version to put into the record header and the legacy
+   version fields for the minor version MINOR.  */
+#define TLS_LEGACY_MINOR_VERSION(minor) ((minor) > TLS_MINOR_VERSION_3 \
+                                         ? TLS_MINOR_VERSION_3 : (minor))
 
 
 #define TLS_RENEGO_MAX_RECORDS_DEFAULT  16
@@ -106,6 +113,16 @@
                          + TLS_PADDING_ADD                      \
                          )
 
+/*
+ * The size of a record buffer for a negotiated maximum fragment
+ * length of N bytes without compression.
+ */
+#define TLS_MFL_BUFFER_LEN(n) ((n)                              \
+                               + 29 /* counter + header + IV */ \
+                               + TLS_MAC_ADD                    \
+                               + TLS_PADDING_ADD                \
+                               )
+
 /*
  * The size of the premaster secret.
  */
@@ -158,6 +175,13 @@ union premaster_secret_u
 #define TLS_SIG_RSA                  1
 #define TLS_SIG_ECDSA                3
 
+/*
+ * The RSASSA-PSS signature schemes (RFC 8446 section 4.2.3) are
+ * encoded with this value in the first octet and the TLS_HASH_ value
+ * in the second octet; i.e. swapped compared to the TLS 1.2 pairs.
+ */
+#define TLS_SIG_RSA_PSS_RSAE         8
+
 /*
  * Client Certificate Types
  * RFC 5246 section 7.4.4 plus RFC 4492 section 5.5
@@ -203,12 +227,15 @@ union premaster_secret_u
 #define TLS_ALERT_MSG_UNSUPPORTED_EXT         110  /* 0x6E */
 #define TLS_ALERT_MSG_UNRECOGNIZED_NAME       112  /* 0x70 */
 #define TLS_ALERT_MSG_UNKNOWN_PSK_IDENTITY    115  /* 0x73 */
+#define TLS_ALERT_MSG_CERT_REQUIRED           116  /* 0x74 */
 #define TLS_ALERT_MSG_NO_APPLICATION_PROTOCOL 120  /* 0x78 */
 
 #define TLS_HS_HELLO_REQUEST            0
 #define TLS_HS_CLIENT_HELLO             1
 #define TLS_HS_SERVER_HELLO             2
 #define TLS_HS_NEW_SESSION_TICKET       4
+#define TLS_HS_END_OF_EARLY_DATA        5  /* TLS 1.3 */
+#define TLS_HS_ENCRYPTED_EXTENSIONS     8  /* TLS 1.3 */
 #define TLS_HS_CERTIFICATE             11
 #define TLS_HS_SERVER_KEY_EXCHANGE     12
 #define TLS_HS_CERTIFICATE_REQUEST     13
@@ -216,6 +243,8 @@ union premaster_secret_u
 #define TLS_HS_CERTIFICATE_VERIFY      15
 #define TLS_HS_CLIENT_KEY_EXCHANGE     16
 #define TLS_HS_FINISHED                20
+#define TLS_HS_KEY_UPDATE              24  /* TLS 1.3 */
+#define TLS_HS_MESSAGE_HASH           254  /* TLS 1.3 */
 
 /*
  * TLS extensions
@@ -227,7 +256,14 @@ union premaster_secret_u
 #define TLS_EXT_SUPPORTED_POINT_FORMATS     11
 #define TLS_EXT_SIG_ALG                     13
 #define TLS_EXT_ALPN                        16
+#define TLS_EXT_ENCRYPT_THEN_MAC            22
 #define TLS_EXT_SESSION_TICKET              35
+#define TLS_EXT_PRE_SHARED_KEY              41
+#define TLS_EXT_EARLY_DATA                  42
+#define TLS_EXT_SUPPORTED_VERSIONS          43
+#define TLS_EXT_COOKIE                      44
+#define TLS_EXT_PSK_KEY_EXCHANGE_MODES      45
+#define TLS_EXT_KEY_SHARE                   51
 #define TLS_EXT_RENEGOTIATION_INFO      0xFF01
 
 /* TLS extension flags (for extensions with outgoing ServerHello
@@ -300,8 +336,8 @@ md_algo_t _ntbtls_md_alg_from_hash (unsigned char hash);
 
 gpg_error_t _ntbtls_derive_keys (ntbtls_t tls);
 
-void _ntbtls_optimize_checksum (ntbtls_t tls,
-                                const ciphersuite_t ciphersuite_info);
+gpg_error_t _ntbtls_optimize_checksum (ntbtls_t tls,
+                                       const ciphersuite_t ciphersuite_info);
 
 gpg_error_t _ntbtls_psk_derive_premaster (ntbtls_t tls,
                                           key_exchange_type_t kex);
@@ -312,6 +348,24 @@ gpg_error_t _ntbtls_read_change_cipher_spec (ntbtls_t tls);
 gpg_error_t _ntbtls_write_finished (ntbtls_t tls);
 gpg_error_t _ntbtls_read_finished (ntbtls_t tls);
 
+gpg_error_t _ntbtls_tls13_hrr_checksum (ntbtls_t tls,
+                                        const ciphersuite_t ciphersuite_info,
+                                        size_t hrrlen);
+gpg_error_t _ntbtls_tls13_transcript_hash (ntbtls_t tls, unsigned char *hash,
+                                           size_t *r_hashlen);
+gpg_error_t _ntbtls_tls13_derive_handshake_keys (ntbtls_t tls);
+gpg_error_t _ntbtls_tls13_end_early_data (ntbtls_t tls);
+gpg_error_t _ntbtls_get_traffic_key (ntbtls_t tls, int outbound,
+                                     unsigned char *key);
+gpg_error_t _ntbtls_tls13_read_certificate (ntbtls_t tls);
+gpg_error_t _ntbtls_tls13_write_finished (ntbtls_t tls);
+gpg_error_t _ntbtls_tls13_read_finished (ntbtls_t tls);
+tls13_ticket_t _ntbtls_tls13_take_ticket (ntbtls_t tls);
+gpg_error_t _ntbtls_tls13_psk_binder (ntbtls_t tls,
+                                      const unsigned char *msg, size_t msglen,
+                                      unsigned char *binder);
+gpg_error_t _ntbtls_tls13_write_early_data (ntbtls_t tls);
+
 void _ntbtls_handshake_wrapup (ntbtls_t tls);
 
 
@@ -327,6 +381,9 @@ gpg_error_t _ntbtls_set_transport (ntbtls_t tls,
 gpg_error_t _ntbtls_get_stream (ntbtls_t tls,
                                 gpgrt_stream_t *r_readfp,
                                 gpgrt_stream_t *r_writefp);
+gpg_error_t _ntbtls_send_file (ntbtls_t tls, int fd,
+                               gpgrt_off_t offset, size_t len,
+                               size_t *r_nwritten);
 
 gpg_error_t _ntbtls_set_verify_cb (ntbtls_t tls,
                                    ntbtls_verify_cb_t cb, void *cb_value);
@@ -336,6 +393,11 @@ const char *_ntbtls_get_hostname (ntbtls_t tls);
 
 gpg_error_t _ntbtls_handshake (ntbtls_t tls);
 
+gpg_error_t _ntbtls_set_early_data (ntbtls_t tls,
+                                    const void *data, size_t datalen);
+gpg_error_t _ntbtls_set_max_fragment_length (ntbtls_t tls,
+                                             unsigned int length);
+
 
 
 /*-- protocol-srv.c --*/
@@ -350,6 +412,9 @@ gpg_error_t _ntbtls_pk_verify (x509_cert_t chain,
                                pk_algo_t pk_alg, md_algo_t md_alg,
                                const unsigned char *hash, size_t hashlen,
                                const unsigned char *sig, size_t siglen);
+gpg_error_t _ntbtls_pk_verify_pss (x509_cert_t chain, md_algo_t md_alg,
+                                   const unsigned char *hash, size_t hashlen,
+                                   const unsigned char *sig, size_t siglen);
 
 gpg_error_t _ntbtls_pk_encrypt (x509_cert_t chain, const unsigned char *input,
                                 size_t ilen, unsigned char *output,
@@ -374,6 +439,7 @@ gpg_error_t _ntbtls_pk_encrypt (x509_cert_t chain, const unsigned char *input,
 
 
 gpg_error_t _ntbtls_x509_cert_new (x509_cert_t *r_cert);
+void _ntbtls_x509_cert_ref (x509_cert_t cert);
 void _ntbtls_x509_cert_release (x509_cert_t crt);
 gpg_error_t _ntbtls_x509_append_cert (x509_cert_t cert,
                                       const void *der, size_t derlen);
@@ -382,6 +448,11 @@ const unsigned char *_ntbtls_x509_get_cert (x509_cert_t cert, int idx,
                                             size_t *r_derlen);
 ksba_cert_t _ntbtls_x509_get_peer_cert (ntbtls_t tls, int idx);
 gpg_error_t _ntbtls_x509_get_pk (x509_cert_t cert, int idx, gcry_sexp_t *r_pk);
+gpg_error_t _ntbtls_x509_set_chain_cache (unsigned int size, unsigned int ttl);
+int _ntbtls_x509_chain_cache_get (const unsigned char *key,
+                                  x509_cert_t *r_chain);
+void _ntbtls_x509_chain_cache_put (const unsigned char *key,
+                                   x509_cert_t chain);
 
 
 int _ntbtls_x509_can_do (x509_privkey_t privkey, pk_algo_t pkalgo);
@@ -390,6 +461,23 @@ gpg_error_t _ntbtls_x509_check_hostname (x509_cert_t cert,
                                          const char *hostname);
 
 
+/*-- ticket.c --*/
+void _ntbtls_ticket_release (tls13_ticket_t ticket);
+gpg_error_t _ntbtls_set_ticket_cache (unsigned int size);
+tls13_ticket_t _ntbtls_ticket_cache_take (const unsigned char *key);
+void _ntbtls_ticket_cache_put (const unsigned char *key,
+                               tls13_ticket_t ticket);
+
+
+/*-- ktls.c --*/
+void _ntbtls_ktls_start (ntbtls_t tls);
+gpg_error_t _ntbtls_ktls_set_key (ntbtls_t tls, int outbound);
+gpg_error_t _ntbtls_ktls_write_record (ntbtls_t tls);
+gpg_error_t _ntbtls_ktls_read_record (ntbtls_t tls);
+gpg_error_t _ntbtls_ktls_send_file (ntbtls_t tls, int fd,
+                                    gpgrt_off_t *offset, size_t *len);
+
+
 /*-- dhm.c --*/
 gpg_error_t _ntbtls_dhm_new (dhm_context_t *r_dhm);
 void _ntbtls_dhm_release (dhm_context_t dhm);
@@ -407,6 +495,9 @@ gpg_error_t _ntbtls_dhm_calc_secret (dhm_context_t dhm,
 /*-- ecdh.c --*/
 gpg_error_t _ntbtls_ecdh_new (ecdh_context_t *r_ecdh);
 void _ntbtls_ecdh_release (ecdh_context_t ecdh);
+gpg_error_t _ntbtls_ecdh_set_curve (ecdh_context_t ecdh, unsigned int tlsid);
+gpg_error_t _ntbtls_ecdh_read_point (ecdh_context_t ecdh,
+                                     const void *buf, size_t buflen);
 gpg_error_t _ntbtls_ecdh_read_params (ecdh_context_t ecdh,
                                       const void *der, size_t derlen,
                                       size_t *r_nparsed);
@@ -416,6 +507,8 @@ gpg_error_t _ntbtls_ecdh_make_public (ecdh_context_t ecdh,
 gpg_error_t _ntbtls_ecdh_calc_secret (ecdh_context_t ecdh,
                                       unsigned char *outbuf, size_t outbufsize,
                                       size_t *r_outbuflen);
+gpg_error_t _ntbtls_ecdh_pool_fill (const char *curve_name,
+                                    unsigned int count);
 
 
 
@@ -77,10 +77,116 @@ pk_algo_from_sexp (gcry_sexp_t pkey)
 }
 
 
-gpg_error_t
-_ntbtls_pk_verify (x509_cert_t chain, pk_algo_t pk_alg, md_algo_t md_alg,
-                   const unsigned char *hash, size_t hashlen,
-                   const unsigned char *sig, size_t siglen)
+/* Parse the DER length at *BUF and store it at R_LEN.  *BUF and
+ * *BUFLEN are updated.  Only lengths up to 0xffff are supported.  */
+static gpg_error_t
+parse_der_length (const unsigned char **buf, size_t *buflen, size_t *r_len)
+{
+  const unsigned char *p = *buf;
+  size_t n = *buflen;
+  size_t len;
+
+  if (!n)
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);
+  len = *p++; n--;
+  if (len == 0x81)
+    {
+      if (!n)
+        return gpg_error (GPG_ERR_BAD_SIGNATURE);
+      len = *p++; n--;
+    }
+  else if (len == 0x82)
+    {
+      if (n < 2)
+        return gpg_error (GPG_ERR_BAD_SIGNATURE);
+      len = buf16_to_size_t (p);
+      p += 2; n -= 2;
+    }
+  else if (len > 0x7f)
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);
+  if (len > n)
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);
+
+  *buf = p;
+  *buflen = n;
+  *r_len = len;
+  return 0;
+}
+
+
+/* Parse the DER encoded INTEGER at *BUF and store a pointer to its
+ * value at R_VAL and its length at R_VALLEN.  *BUF and *BUFLEN are
+ * updated.  */
+static gpg_error_t
+parse_der_integer (const unsigned char **buf, size_t *buflen,
+                   const unsigned char **r_val, size_t *r_vallen)
+{
+  gpg_error_t err;
+  size_t len;
+
+  if (!*buflen || **buf != 0x02)
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);
+  (*buf)++; (*buflen)--;
+  err = parse_der_length (buf, buflen, &len);
+  if (err)
+    return err;
+  if (!len || (**buf & 0x80))  /* Empty or negative.  */
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);
+
+  *r_val = *buf;
+  *r_vallen = len;
+  *buf += len;
+  *buflen -= len;
+  return 0;
+}
+
+
+/* Parse the ECDSA signature SIG of length SIGLEN and build the
+ * S-expression for it at R_SIG.  The signature is encoded as
+ *
+ *   Ecdsa-Sig-Value ::= SEQUENCE {
+ *       r       INTEGER,
+ *       s       INTEGER
+ *   }
+ * (RFC 4492, 5.4).  */
+static gpg_error_t
+ecdsa_sig_to_sexp (const unsigned char *sig, size_t siglen,
+                   gcry_sexp_t *r_sig)
+{
+  gpg_error_t err;
+  size_t len;
+  const unsigned char *r, *s;
+  size_t rlen, slen;
+
+  if (!siglen || *sig != 0x30)
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);
+  sig++; siglen--;
+  err = parse_der_length (&sig, &siglen, &len);
+  if (err)
+    return err;
+  if (len != siglen)
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);
+
+  err = parse_der_integer (&sig, &siglen, &r, &rlen);
+  if (!err)
+    err = parse_der_integer (&sig, &siglen, &s, &slen);
+  if (err)
+    return err;
+  if (siglen)
+    return gpg_error (GPG_ERR_BAD_SIGNATURE);  /* Trailing garbage.  */
+
+  return gcry_sexp_build (r_sig, NULL, "(sig-val(ecdsa(r%b)(s%b)))",
+                          (int)rlen, r, (int)slen, s);
+}
+
+
+/* Common code for _ntbtls_pk_verify and _ntbtls_pk_verify_pss.  If
+ * PSS is set PK_ALG must be RSA and a RSASSA-PSS signature with a
+ * salt of the length of the hash is expected.  */
+static gpg_error_t
+do_pk_verify (x509_cert_t chain, pk_algo_t pk_alg, md_algo_t md_alg,
+              const unsigned char *hash, size_t hashlen,
+              const unsigned char *sig, size_t siglen, int pss)
 {
   gpg_error_t err;
   gcry_sexp_t s_pk = NULL;
@@ -95,7 +201,8 @@ _ntbtls_pk_verify (x509_cert_t chain, pk_algo_t pk_alg, md_algo_t md_alg,
   if (!md_alg_str)
     return gpg_error (GPG_ERR_DIGEST_ALGO);
 
-  /* Get the public key from the first certificate.  */
+  /* Get the public key from the first certificate.  Note that S_PK
+   * belongs to CHAIN.  */
   err = _ntbtls_x509_get_pk (chain, 0, &s_pk);
   if (err)
     goto leave;
@@ -114,9 +221,19 @@ _ntbtls_pk_verify (x509_cert_t chain, pk_algo_t pk_alg, md_algo_t md_alg,
       goto leave;
   }
 
-  /* Put the hash into an s-expression.  */
-  err = gcry_sexp_build (&s_hash, NULL, "(data(flags pkcs1)(hash %s %b))",
-                         md_alg_str, (int)hashlen, hash);
+  /* Put the hash into an s-expression.  For ECDSA we need to tell
+   * Libgcrypt the hash algorithm so that a hash longer than the order
+   * of the curve is properly truncated (e.g. SHA-512 with P-256).  */
+  if (pk_alg == GCRY_PK_ECC)
+    err = gcry_sexp_build (&s_hash, NULL, "(data(flags raw)(hash %s %b))",
+                           md_alg_str, (int)hashlen, hash);
+  else if (pss)
+    err = gcry_sexp_build (&s_hash, NULL,
+                           "(data(flags pss)(hash %s %b)(salt-length %d))",
+                           md_alg_str, (int)hashlen, hash, (int)hashlen);
+  else
+    err = gcry_sexp_build (&s_hash, NULL, "(data(flags pkcs1)(hash %s %b))",
+                           md_alg_str, (int)hashlen, hash);
   if (err)
     goto leave;
 
@@ -133,10 +250,9 @@ _ntbtls_pk_verify (x509_cert_t chain, pk_algo_t pk_alg, md_algo_t md_alg,
     /*                          data[0], data[1]); */
     /*   break; */
 
-    /* case PUBKEY_PK_ECC: */
-    /*   err = gcry_sexp_build (&s_sig, NULL, "(sig-val(ecdsa(r%m)(s%m)))", */
-    /*                          data[0], data[1]); */
-    /*   break; */
+    case GCRY_PK_ECC:
+      err = ecdsa_sig_to_sexp (sig, siglen, &s_sig);
+      break;
 
     default:
       err = gpg_error (GPG_ERR_NOT_IMPLEMENTED);
@@ -153,12 +269,33 @@ _ntbtls_pk_verify (x509_cert_t chain, pk_algo_t pk_alg, md_algo_t md_alg,
 
 
  leave:
-  gcry_sexp_release (s_pk);
   gcry_sexp_release (s_hash);
   gcry_sexp_release (s_sig);
   return err;
 }
 
+
+gpg_error_t
+_ntbtls_pk_verify (x509_cert_t chain, pk_algo_t pk_alg, md_algo_t md_alg,
+                   const unsigned char *hash, size_t hashlen,
+                   const unsigned char *sig, size_t siglen)
+{
+  return do_pk_verify (chain, pk_alg, md_alg, hash, hashlen, sig, siglen, 0);
+}
+
+
+/* Verify an RSASSA-PSS signature (rsa_pss_rsae_*) made with the RSA
+ * key from the first certificate of CHAIN.  */
+gpg_error_t
+_ntbtls_pk_verify_pss (x509_cert_t chain, md_algo_t md_alg,
+                       const unsigned char *hash, size_t hashlen,
+                       const unsigned char *sig, size_t siglen)
+{
+  return do_pk_verify (chain, GCRY_PK_RSA, md_alg, hash, hashlen,
+                       sig, siglen, 1);
+}
+
+
 gpg_error_t
 _ntbtls_pk_encrypt (x509_cert_t chain,
                     const unsigned char *input, size_t ilen,
@@ -171,7 +308,8 @@ _ntbtls_pk_encrypt (x509_cert_t chain,
   size_t len;
   const char *data;
 
-  /* Get the public key from the first certificate.  */
+  /* Get the public key from the first certificate.  Note that S_PK
+   * belongs to CHAIN.  */
   err = _ntbtls_x509_get_pk (chain, 0, &s_pk);
   if (err)
     return err;
@@ -179,16 +317,11 @@ _ntbtls_pk_encrypt (x509_cert_t chain,
   err = gcry_sexp_build (&s_data, NULL, "(data (flags pkcs1) (value %b))",
                          (int)ilen, input);
   if (err)
-    {
-      gcry_sexp_release (s_pk);
-      return err;
-    }
+    return err;
 
   err = gcry_pk_encrypt (&s_ciph, s_data, s_pk);
   gcry_sexp_release (s_data);
   s_data = NULL;
-  gcry_sexp_release (s_pk);
-  s_pk = NULL;
   if (err)
     return err;
 
@@ -123,14 +123,22 @@ write_signature_algorithms_ext (ntbtls_t ssl,
 
   *olen = 0;
 
-  if (ssl->max_minor_ver != TLS_MINOR_VERSION_3)
+  if (ssl->max_minor_ver < TLS_MINOR_VERSION_3)
     return;
 
   debug_msg (3, "client_hello, adding signature_algorithms extension");
 
   /*
-   * Prepare signature_algorithms extension (TLS 1.2)
+   * Prepare signature_algorithms extension (TLS 1.2).  The RSASSA-PSS
+   * schemes are required for RSA certificates with TLS 1.3 and may
+   * also be used by a TLS 1.2 server (RFC 8446, 4.2.3).
    */
+  sig_alg_list[sig_alg_len++] = TLS_SIG_RSA_PSS_RSAE;
+  sig_alg_list[sig_alg_len++] = TLS_HASH_SHA256;
+  sig_alg_list[sig_alg_len++] = TLS_SIG_RSA_PSS_RSAE;
+  sig_alg_list[sig_alg_len++] = TLS_HASH_SHA384;
+  sig_alg_list[sig_alg_len++] = TLS_SIG_RSA_PSS_RSAE;
+  sig_alg_list[sig_alg_len++] = TLS_HASH_SHA512;
   sig_alg_list[sig_alg_len++] = TLS_HASH_SHA512;
   sig_alg_list[sig_alg_len++] = TLS_SIG_RSA;
   sig_alg_list[sig_alg_len++] = TLS_HASH_SHA384;
@@ -195,7 +203,15 @@ write_supported_elliptic_curves_ext (ntbtls_t tls,
 
   debug_msg (3, "client hello, adding supported_elliptic_curves extension");
 
-  /* The 6 curves we support; see _ntbtls_ecdh_read_params.  */
+  /* The 8 curves we support; see _ntbtls_ecdh_read_params.  We list
+   * X25519 and X448 first because they are the fastest.  */
+  elliptic_curve_list[elliptic_curve_len++] = 0;
+  elliptic_curve_list[elliptic_curve_len++] = 29;
+  if (gcry_check_version ("1.9.0"))  /* X448 requires Libgcrypt 1.9.  */
+    {
+      elliptic_curve_list[elliptic_curve_len++] = 0;
+      elliptic_curve_list[elliptic_curve_len++] = 30;
+    }
   elliptic_curve_list[elliptic_curve_len++] = 0;
   elliptic_curve_list[elliptic_curve_len++] = 23;
   elliptic_curve_list[elliptic_curve_len++] = 0;
@@ -295,6 +311,30 @@ write_cli_truncated_hmac_ext (ntbtls_t tls,
 }
 
 
+static void
+write_cli_encrypt_then_mac_ext (ntbtls_t tls,
+                                unsigned char *buf, size_t * olen)
+{
+  unsigned char *p = buf;
+
+  if (!tls->use_encrypt_then_mac)
+    {
+      *olen = 0;
+      return;
+    }
+
+  debug_msg (3, "client_hello, adding encrypt_then_mac extension");
+
+  *p++ = (unsigned char) ((TLS_EXT_ENCRYPT_THEN_MAC >> 8) & 0xFF);
+  *p++ = (unsigned char) ((TLS_EXT_ENCRYPT_THEN_MAC) & 0xFF);
+
+  *p++ = 0x00;
+  *p++ = 0x00;
+
+  *olen = 4;
+}
+
+
 static void
 write_cli_session_ticket_ext (ntbtls_t ssl,
                               unsigned char *buf, size_t * olen)
@@ -379,6 +419,270 @@ write_cli_alpn_ext (ntbtls_t ssl, unsigned char *buf, size_t * olen)
 }
 
 
+/* Return true if we offer TLS 1.3.  TLS 1.3 is not offered when
+ * renegotiating a TLS 1.2 connection.  */
+static int
+offer_tls13 (ntbtls_t tls)
+{
+  return (tls->max_minor_ver >= TLS_MINOR_VERSION_4
+          && tls->renegotiation == TLS_INITIAL_HANDSHAKE);
+}
+
+
+static void
+write_cli_supported_versions_ext (ntbtls_t tls,
+                                  unsigned char *buf, size_t *olen)
+{
+  unsigned char *p = buf;
+
+  *olen = 0;
+
+  if (!offer_tls13 (tls))
+    return;
+
+  debug_msg (3, "client_hello, adding supported_versions extension");
+
+  *p++ = (unsigned char) ((TLS_EXT_SUPPORTED_VERSIONS >> 8) & 0xFF);
+  *p++ = (unsigned char) ((TLS_EXT_SUPPORTED_VERSIONS) & 0xFF);
+
+  *p++ = 0x00;
+  *p++ = 5;
+
+  *p++ = 4;
+  *p++ = TLS_MAJOR_VERSION_3;
+  *p++ = TLS_MINOR_VERSION_4;
+  *p++ = TLS_MAJOR_VERSION_3;
+  *p++ = TLS_MINOR_VERSION_3;
+
+  *olen = 9;
+}
+
+
+/* Write the key_share extension with a single share for X25519 or
+ * for the group requested by a HelloRetryRequest.  */
+static gpg_error_t
+write_cli_key_share_ext (ntbtls_t tls, unsigned char *buf, size_t *olen)
+{
+  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  size_t n;
+
+  *olen = 0;
+
+  if (!offer_tls13 (tls))
+    return 0;
+
+  debug_msg (3, "client_hello, adding key_share extension");
+
+  if (!hs->key_share_group)
+    hs->key_share_group = 29;  /* X25519 */
+
+  /*
+   *     0  .   1   extension type
+   *     2  .   3   extension length
+   *     4  .   5   length of client_shares
+   *     6  .   7   group
+   *     8  .   9   length of key_exchange
+   *    10  . ...   key_exchange
+   *
+   * _ntbtls_ecdh_make_public writes the point with a one octet
+   * length which we extend to two octets.
+   */
+  err = _ntbtls_ecdh_set_curve (hs->ecdh_ctx, hs->key_share_group);
+  if (!err)
+    err = _ntbtls_ecdh_make_public (hs->ecdh_ctx, buf + 9, 256, &n);
+  if (err)
+    {
+      debug_ret (1, "ecdh_make_public", err);
+      return err;
+    }
+  n--;
+
+  buf[0] = (unsigned char) ((TLS_EXT_KEY_SHARE >> 8) & 0xFF);
+  buf[1] = (unsigned char) ((TLS_EXT_KEY_SHARE) & 0xFF);
+  buf[2] = (unsigned char) (((n + 6) >> 8) & 0xFF);
+  buf[3] = (unsigned char) (((n + 6)) & 0xFF);
+  buf[4] = (unsigned char) (((n + 4) >> 8) & 0xFF);
+  buf[5] = (unsigned char) (((n + 4)) & 0xFF);
+  buf[6] = (unsigned char) ((hs->key_share_group >> 8) & 0xFF);
+  buf[7] = (unsigned char) ((hs->key_share_group) & 0xFF);
+  buf[8] = 0x00;
+
+  *olen = 10 + n;
+  return 0;
+}
+
+
+/* Echo the cookie from a HelloRetryRequest.  */
+static void
+write_cli_cookie_ext (ntbtls_t tls, unsigned char *buf, size_t *olen)
+{
+  handshake_params_t hs = tls->handshake;
+  unsigned char *p = buf;
+
+  *olen = 0;
+
+  if (!hs->cookie)
+    return;
+
+  debug_msg (3, "client_hello, adding cookie extension");
+
+  *p++ = (unsigned char) ((TLS_EXT_COOKIE >> 8) & 0xFF);
+  *p++ = (unsigned char) ((TLS_EXT_COOKIE) & 0xFF);
+
+  *p++ = (unsigned char) (((hs->cookie_len + 2) >> 8) & 0xFF);
+  *p++ = (unsigned char) (((hs->cookie_len + 2)) & 0xFF);
+
+  *p++ = (unsigned char) ((hs->cookie_len >> 8) & 0xFF);
+  *p++ = (unsigned char) ((hs->cookie_len) & 0xFF);
+
+  memcpy (p, hs->cookie, hs->cookie_len);
+
+  *olen = 6 + hs->cookie_len;
+}
+
+
+static void
+write_cli_psk_key_exchange_modes_ext (ntbtls_t tls,
+                                      unsigned char *buf, size_t *olen)
+{
+  unsigned char *p = buf;
+
+  *olen = 0;
+
+  if (!offer_tls13 (tls))
+    return;
+
+  debug_msg (3, "client_hello, adding psk_key_exchange_modes extension");
+
+  /* We only support psk_dhe_ke so that a resumed session still has
+   * forward secrecy.  */
+  *p++ = (unsigned char) ((TLS_EXT_PSK_KEY_EXCHANGE_MODES >> 8) & 0xFF);
+  *p++ = (unsigned char) ((TLS_EXT_PSK_KEY_EXCHANGE_MODES) & 0xFF);
+
+  *p++ = 0x00;
+  *p++ = 2;
+
+  *p++ = 1;
+  *p++ = 1;  /* psk_dhe_ke */
+
+  *olen = 6;
+}
+
+
+/* Return the length of the hash used by the TLS 1.3 SUITE.  */
+static size_t
+suite_hashlen (ciphersuite_t suite)
+{
+  return _ntbtls_ciphersuite_get_mac (suite) == GCRY_MAC_HMAC_SHA384? 48:32;
+}
+
+
+/* Return the length of the hash used with TICKET.  */
+static size_t
+ticket_hashlen (tls13_ticket_t ticket)
+{
+  return suite_hashlen (_ntbtls_ciphersuite_from_id (ticket->ciphersuite));
+}
+
+
+/* Return true if the early data shall be sent with the ClientHello.
+ * This requires a ticket which allows for enough early data.  */
+static int
+want_early_data (ntbtls_t tls)
+{
+  handshake_params_t hs = tls->handshake;
+
+  return (tls->early_data && hs->psk_ticket && !hs->hello_retry
+          && tls->early_data_len <= hs->psk_ticket->max_early_data);
+}
+
+
+static void
+write_cli_early_data_ext (ntbtls_t tls, unsigned char *buf, size_t *olen)
+{
+  unsigned char *p = buf;
+
+  *olen = 0;
+
+  if (!want_early_data (tls))
+    return;
+
+  debug_msg (3, "client_hello, adding early_data extension");
+
+  *p++ = (unsigned char) ((TLS_EXT_EARLY_DATA >> 8) & 0xFF);
+  *p++ = (unsigned char) ((TLS_EXT_EARLY_DATA) & 0xFF);
+
+  *p++ = 0x00;
+  *p++ = 0x00;
+
+  *olen = 4;
+}
+
+
+/* Write the pre_shared_key extension for the ticket to be offered.
+ * The binder is left zero; it is computed over the complete
+ * ClientHello by write_client_hello.  This extension must be the last
+ * one.  */
+static void
+write_cli_pre_shared_key_ext (ntbtls_t tls, unsigned char *buf, size_t *olen)
+{
+  tls13_ticket_t ticket = tls->handshake->psk_ticket;
+  unsigned char *p = buf;
+  size_t hashlen;
+  uint32_t age;
+
+  *olen = 0;
+
+  if (!ticket)
+    return;
+
+  debug_msg (3, "client_hello, adding pre_shared_key extension");
+
+  hashlen = ticket_hashlen (ticket);
+
+  /* The obfuscated age in milliseconds.  */
+  age = (uint32_t)(time (NULL) - ticket->received) * 1000 + ticket->age_add;
+
+  /*
+   *     0  .   1   extension type
+   *     2  .   3   extension length
+   *     4  .   5   length of identities
+   *     6  .   7   length of identity
+   *     8  . ...   identity, obfuscated_ticket_age (4),
+   *                length of binders (2),
+   *                length of binder (1), binder
+   */
+  *p++ = (unsigned char) ((TLS_EXT_PRE_SHARED_KEY >> 8) & 0xFF);
+  *p++ = (unsigned char) ((TLS_EXT_PRE_SHARED_KEY) & 0xFF);
+
+  *p++ = (unsigned char) (((ticket->ticket_len + 11 + hashlen) >> 8) & 0xFF);
+  *p++ = (unsigned char) (((ticket->ticket_len + 11 + hashlen)) & 0xFF);
+
+  *p++ = (unsigned char) (((ticket->ticket_len + 6) >> 8) & 0xFF);
+  *p++ = (unsigned char) (((ticket->ticket_len + 6)) & 0xFF);
+
+  *p++ = (unsigned char) ((ticket->ticket_len >> 8) & 0xFF);
+  *p++ = (unsigned char) ((ticket->ticket_len) & 0xFF);
+  memcpy (p, ticket->ticket, ticket->ticket_len);
+  p += ticket->ticket_len;
+
+  *p++ = (unsigned char) (age >> 24);
+  *p++ = (unsigned char) (age >> 16);
+  *p++ = (unsigned char) (age >> 8);
+  *p++ = (unsigned char) (age);
+
+  *p++ = (unsigned char) (((hashlen + 1) >> 8) & 0xFF);
+  *p++ = (unsigned char) (((hashlen + 1)) & 0xFF);
+
+  *p++ = (unsigned char) hashlen;
+  memset (p, 0, hashlen);
+  p += hashlen;
+
+  *olen = p - buf;
+}
+
+
 static gpg_error_t
 write_client_hello (ntbtls_t tls)
 {
@@ -393,12 +697,20 @@ write_client_hello (ntbtls_t tls)
 
   debug_msg (2, "write client_hello");
 
-  if (tls->renegotiation == TLS_INITIAL_HANDSHAKE)
+  if (tls->renegotiation == TLS_INITIAL_HANDSHAKE
+      && !tls->handshake->hello_retry)
     {
       tls->major_ver = tls->min_major_ver;
       tls->minor_ver = tls->min_minor_ver;
     }
 
+  /* Look for a ticket to resume a TLS 1.3 session.  */
+  if (offer_tls13 (tls) && !tls->handshake->hello_retry)
+    {
+      _ntbtls_ticket_release (tls->handshake->psk_ticket);
+      tls->handshake->psk_ticket = _ntbtls_tls13_take_ticket (tls);
+    }
+
   if (tls->max_major_ver == 0 && tls->max_minor_ver == 0)
     {
       tls->max_major_ver = TLS_MAX_MAJOR_VERSION;
@@ -416,23 +728,33 @@ write_client_hello (ntbtls_t tls)
   p = buf + 4;
 
   *p++ = (unsigned char) tls->max_major_ver;
-  *p++ = (unsigned char) tls->max_minor_ver;
+  *p++ = (unsigned char) TLS_LEGACY_MINOR_VERSION (tls->max_minor_ver);
 
   debug_msg (3, "client_hello, max version: [%d:%d]", buf[4], buf[5]);
 
-  t = time (NULL);
-  *p++ = (unsigned char) (t >> 24);
-  *p++ = (unsigned char) (t >> 16);
-  *p++ = (unsigned char) (t >> 8);
-  *p++ = (unsigned char) (t);
+  if (tls->handshake->hello_retry)
+    {
+      /* The ClientHello sent in response to a HelloRetryRequest
+       * uses the same random.  */
+      memcpy (p, tls->handshake->randbytes, 32);
+      p += 32;
+    }
+  else
+    {
+      t = time (NULL);
+      *p++ = (unsigned char) (t >> 24);
+      *p++ = (unsigned char) (t >> 16);
+      *p++ = (unsigned char) (t >> 8);
+      *p++ = (unsigned char) (t);
 
-  debug_msg (3, "client_hello, current time: %lu", t);
+      debug_msg (3, "client_hello, current time: %lu", t);
 
-  //FIXME: Check RNG requirements.
-  gcry_create_nonce (p, 28);
-  p += 28;
+      //FIXME: Check RNG requirements.
+      gcry_create_nonce (p, 28);
+      p += 28;
 
-  memcpy (tls->handshake->randbytes, buf + 6, 32);
+      memcpy (tls->handshake->randbytes, buf + 6, 32);
+    }
 
   debug_buf (3, "client_hello, random bytes", buf + 6, 32);
 
@@ -448,22 +770,33 @@ write_client_hello (ntbtls_t tls)
    */
   n = tls->session_negotiate->length;
 
-  if (tls->renegotiation != TLS_INITIAL_HANDSHAKE || n < 16 || n > 32 ||
-      tls->handshake->resume == 0)
+  if (tls->handshake->hello_retry)
+    ; /* Send the same session id again.  */
+  else
     {
-      n = 0;
-    }
+      if (tls->renegotiation != TLS_INITIAL_HANDSHAKE || n < 16 || n > 32 ||
+          tls->handshake->resume == 0)
+        {
+          n = 0;
+        }
 
-  /*
-   * RFC 5077 section 3.4: "When presenting a ticket, the client MAY
-   * generate and include a Session ID in the TLS ClientHello."
-   */
-  if (tls->renegotiation == TLS_INITIAL_HANDSHAKE &&
-      tls->session_negotiate->ticket != NULL &&
-      tls->session_negotiate->ticket_len != 0)
-    {
-      gcry_create_nonce (tls->session_negotiate->id, 32);
-      tls->session_negotiate->length = n = 32;
+      /*
+       * RFC 5077 section 3.4: "When presenting a ticket, the client MAY
+       * generate and include a Session ID in the TLS ClientHello."
+       *
+       * RFC 8446 appendix D.4: A client offering TLS 1.3 sends a
+       * non-empty session id for middlebox compatibility; the server
+       * echoes it.
+       */
+      if ((tls->renegotiation == TLS_INITIAL_HANDSHAKE &&
+           tls->session_negotiate->ticket != NULL &&
+           tls->session_negotiate->ticket_len != 0)
+          || (!n && offer_tls13 (tls)))
+        {
+          gcry_create_nonce (tls->session_negotiate->id, 32);
+          n = 32;
+        }
+      tls->session_negotiate->length = n;
     }
 
   *p++ = (unsigned char) n;
@@ -502,7 +835,9 @@ write_client_hello (ntbtls_t tls)
         continue;
 
       if (!_ntbtls_ciphersuite_version_ok (suite, tls->min_minor_ver,
-                                           tls->max_minor_ver))
+                                           (offer_tls13 (tls)
+                                            ? tls->max_minor_ver
+                                            : TLS_MINOR_VERSION_3)))
         continue;
 
       debug_msg (5, "client_hello, add ciphersuite: %5d %s",
@@ -520,13 +855,25 @@ write_client_hello (ntbtls_t tls)
 
   debug_msg (3, "client_hello, got %zu ciphersuites", n);
 
-  debug_msg (3, "client_hello, compress len.: %d", 2);
-  debug_msg (3, "client_hello, compress alg.: %d %d",
-             TLS_COMPRESS_DEFLATE, TLS_COMPRESS_NULL);
+  /* A ClientHello offering TLS 1.3 must only list the NULL method.  */
+  if (offer_tls13 (tls))
+    {
+      debug_msg (3, "client_hello, compress len.: %d", 1);
+      debug_msg (3, "client_hello, compress alg.: %d", TLS_COMPRESS_NULL);
 
-  *p++ = 2;
-  *p++ = TLS_COMPRESS_DEFLATE;
-  *p++ = TLS_COMPRESS_NULL;
+      *p++ = 1;
+      *p++ = TLS_COMPRESS_NULL;
+    }
+  else
+    {
+      debug_msg (3, "client_hello, compress len.: %d", 2);
+      debug_msg (3, "client_hello, compress alg.: %d %d",
+                 TLS_COMPRESS_DEFLATE, TLS_COMPRESS_NULL);
+
+      *p++ = 2;
+      *p++ = TLS_COMPRESS_DEFLATE;
+      *p++ = TLS_COMPRESS_NULL;
+    }
 
   /* First write extensions, then the total length.  */
   write_hostname_ext (tls, p + 2 + ext_len, &olen);
@@ -550,12 +897,35 @@ write_client_hello (ntbtls_t tls)
   write_cli_truncated_hmac_ext (tls, p + 2 + ext_len, &olen);
   ext_len += olen;
 
+  write_cli_encrypt_then_mac_ext (tls, p + 2 + ext_len, &olen);
+  ext_len += olen;
+
   write_cli_session_ticket_ext (tls, p + 2 + ext_len, &olen);
   ext_len += olen;
 
   write_cli_alpn_ext (tls, p + 2 + ext_len, &olen);
   ext_len += olen;
 
+  write_cli_supported_versions_ext (tls, p + 2 + ext_len, &olen);
+  ext_len += olen;
+
+  err = write_cli_key_share_ext (tls, p + 2 + ext_len, &olen);
+  if (err)
+    return err;
+  ext_len += olen;
+
+  write_cli_cookie_ext (tls, p + 2 + ext_len, &olen);
+  ext_len += olen;
+
+  write_cli_psk_key_exchange_modes_ext (tls, p + 2 + ext_len, &olen);
+  ext_len += olen;
+
+  write_cli_early_data_ext (tls, p + 2 + ext_len, &olen);
+  ext_len += olen;
+
+  write_cli_pre_shared_key_ext (tls, p + 2 + ext_len, &olen);
+  ext_len += olen;
+
   debug_msg (3, "client_hello, total extension length: %zu", ext_len);
 
   if (ext_len > 0)
@@ -569,6 +939,24 @@ write_client_hello (ntbtls_t tls)
   tls->out_msgtype = TLS_MSG_HANDSHAKE;
   tls->out_msg[0] = TLS_HS_CLIENT_HELLO;
 
+  if (tls->handshake->psk_ticket)
+    {
+      /* The binder is the last item of the message and covers
+       * everything before the list of binders including the
+       * handshake header.  */
+      n = ticket_hashlen (tls->handshake->psk_ticket);
+      buf[1] = (unsigned char) (((tls->out_msglen - 4) >> 16) & 0xFF);
+      buf[2] = (unsigned char) (((tls->out_msglen - 4) >> 8) & 0xFF);
+      buf[3] = (unsigned char) (((tls->out_msglen - 4)) & 0xFF);
+      err = _ntbtls_tls13_psk_binder (tls, buf, tls->out_msglen - 3 - n,
+                                      buf + tls->out_msglen - n);
+      if (err)
+        {
+          debug_ret (1, "tls13_psk_binder", err);
+          return err;
+        }
+    }
+
   tls->state++;
 
   err = _ntbtls_write_record (tls);
@@ -578,6 +966,16 @@ write_client_hello (ntbtls_t tls)
       return err;
     }
 
+  if (want_early_data (tls))
+    {
+      err = _ntbtls_tls13_write_early_data (tls);
+      if (err)
+        {
+          debug_ret (1, "tls13_write_early_data", err);
+          return err;
+        }
+    }
+
   return 0;
 }
 
@@ -639,6 +1037,8 @@ parse_max_fragment_length_ext (ntbtls_t tls,
       return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
     }
 
+  tls->session_negotiate->mfl_code = buf[0];
+
   return 0;
 }
 
@@ -659,6 +1059,35 @@ parse_truncated_hmac_ext (ntbtls_t tls, const unsigned char *buf, size_t len)
 }
 
 
+static gpg_error_t
+parse_encrypt_then_mac_ext (ntbtls_t tls,
+                            const unsigned char *buf, size_t len)
+{
+  cipher_mode_t mode;
+
+  (void)buf;
+
+  if (!tls->use_encrypt_then_mac || len)
+    {
+      return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+
+  /* RFC 7366 does not apply to AEAD and stream ciphers; a server
+   * must not send the extension for them.  */
+  _ntbtls_ciphersuite_get_cipher (tls->transform_negotiate->ciphersuite,
+                                  &mode);
+  if (mode != GCRY_CIPHER_MODE_CBC)
+    {
+      debug_msg (1, "encrypt_then_mac sent for a non-CBC ciphersuite");
+      return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+
+  tls->session_negotiate->encrypt_then_mac = 1;
+
+  return 0;
+}
+
+
 static gpg_error_t
 parse_session_ticket_ext (ntbtls_t tls, const unsigned char *buf, size_t len)
 {
@@ -757,10 +1186,335 @@ parse_alpn_ext (ntbtls_t tls, const unsigned char *buf, size_t len)
 }
 
 
+/* Return the version from a supported_versions extension of the
+ * ServerHello at BUF at R_VERSION or 0 if the extension is not
+ * present.  */
+static gpg_error_t
+get_server_supported_version (ntbtls_t tls, const unsigned char *buf,
+                              unsigned int *r_version)
+{
+  size_t n, ext_len;
+  const unsigned char *ext;
+
+  *r_version = 0;
+
+  n = buf[38];
+  if (n > 32 || tls->in_hslen < 42 + n)
+    return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+  if (tls->in_hslen == 42 + n)
+    return 0;  /* No extensions.  */
+
+  ext_len = buf16_to_size_t (buf + 42 + n);
+  if (tls->in_hslen != 44 + n + ext_len)
+    return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+
+  for (ext = buf + 44 + n; ext_len >= 4; )
+    {
+      unsigned int ext_id   = buf16_to_uint (ext);
+      unsigned int ext_size = buf16_to_uint (ext+2);
+
+      if (ext_size + 4 > ext_len)
+        return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+
+      if (ext_id == TLS_EXT_SUPPORTED_VERSIONS)
+        {
+          if (ext_size != 2)
+            return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+          *r_version = buf16_to_uint (ext + 4);
+          return 0;
+        }
+
+      ext_len -= 4 + ext_size;
+      ext += 4 + ext_size;
+    }
+
+  if (ext_len)
+    return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+
+  return 0;
+}
+
+
+/* Send an illegal_parameter alert and return ERRCODE.  */
+static gpg_error_t
+illegal_parameter (ntbtls_t tls, gpg_err_code_t errcode)
+{
+  _ntbtls_send_alert_message (tls, TLS_ALERT_LEVEL_FATAL,
+                              TLS_ALERT_MSG_ILLEGAL_PARAMETER);
+  return gpg_error (errcode);
+}
+
+
+/* Process a TLS 1.3 ServerHello or HelloRetryRequest which has
+ * already been read into IN_MSG.  */
+static gpg_error_t
+read_server_hello_tls13 (ntbtls_t tls)
+{
+  /* RFC 8446 4.1.3: The Random of a HelloRetryRequest.  */
+  static const unsigned char hrr_random[32] = {
+    0xcf, 0x21, 0xad, 0x74, 0xe5, 0x9a, 0x61, 0x11,
+    0xbe, 0x1d, 0x8c, 0x02, 0x1e, 0x65, 0xb8, 0x91,
+    0xc2, 0xa2, 0x11, 0x16, 0x7a, 0xbb, 0x8c, 0x5e,
+    0x07, 0x9e, 0x09, 0xe2, 0xc8, 0xa8, 0x33, 0x9c
+  };
+  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  unsigned char *buf = tls->in_msg;
+  unsigned char *ext;
+  const unsigned char *share = NULL;
+  const unsigned char *cookie = NULL;
+  size_t n, ext_len, share_len = 0, cookie_len = 0;
+  unsigned int group = 0;
+  int i, suite_id, is_hrr;
+  int psk_selected = 0;
+  const int *ciphersuites;
+  ciphersuite_t suite;
+
+  is_hrr = !memcmp (buf + 6, hrr_random, 32);
+
+  debug_msg (2, "server_hello is a TLS 1.3 %s",
+             is_hrr? "HelloRetryRequest" : "ServerHello");
+
+  /* The length of the message has already been checked by
+   * get_server_supported_version.  */
+  n = buf[38];
+  if (buf[5] != TLS_MINOR_VERSION_3
+      || n != tls->session_negotiate->length
+      || memcmp (buf + 39, tls->session_negotiate->id, n)
+      || buf[41 + n] != TLS_COMPRESS_NULL)
+    {
+      debug_msg (1, "bad server_hello message");
+      return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+
+  suite_id = buf16_to_uint (buf + 39 + n);
+  suite = _ntbtls_ciphersuite_from_id (suite_id);
+
+  debug_msg (1, "server_hello, chosen ciphersuite: %d (%s)",
+             suite_id, _ntbtls_ciphersuite_get_name (suite_id));
+
+  ciphersuites = tls->ciphersuite_list[TLS_MINOR_VERSION_4];
+  if (ciphersuites)
+    {
+      for (i=0; ciphersuites[i]; i++)
+        if (ciphersuites[i] == suite_id)
+          break;
+    }
+  if (!ciphersuites || !ciphersuites[i]
+      || !_ntbtls_ciphersuite_version_ok (suite, TLS_MINOR_VERSION_4,
+                                          TLS_MINOR_VERSION_4)
+      || (hs->hello_retry
+          && tls->transform_negotiate->ciphersuite != suite))
+    {
+      debug_msg (1, "bad server_hello message");
+      return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+
+  ext_len = buf16_to_size_t (buf + 42 + n);
+  ext = buf + 44 + n;
+  while (ext_len)
+    {
+      unsigned int ext_id, ext_size;
+
+      if (ext_len < 4
+          || (ext_size = buf16_to_uint (ext+2)) + 4 > ext_len)
+        {
+          debug_msg (1, "bad server_hello message");
+          return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+        }
+      ext_id = buf16_to_uint (ext);
+
+      switch (ext_id)
+        {
+        case TLS_EXT_SUPPORTED_VERSIONS:
+          /* Already checked.  */
+          break;
+
+        case TLS_EXT_KEY_SHARE:
+          debug_msg (2, "found key_share extension");
+          /*
+           * HelloRetryRequest:  NamedGroup selected_group;
+           * ServerHello:        NamedGroup group;
+           *                     opaque key_exchange<1..2^16-1>;
+           */
+          if (ext_size < 2)
+            return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+          group = buf16_to_uint (ext + 4);
+          if (is_hrr)
+            {
+              if (ext_size != 2)
+                return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+            }
+          else
+            {
+              if (ext_size < 4
+                  || buf16_to_size_t (ext + 6) != ext_size - 4
+                  || ext_size == 4)
+                return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+              share = ext + 8;
+              share_len = ext_size - 4;
+            }
+          break;
+
+        case TLS_EXT_PRE_SHARED_KEY:
+          debug_msg (2, "found pre_shared_key extension");
+          /* We offer only one identity.  */
+          if (is_hrr || !hs->psk_ticket
+              || ext_size != 2 || buf16_to_uint (ext + 4))
+            return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+          psk_selected = 1;
+          break;
+
+        case TLS_EXT_COOKIE:
+          debug_msg (2, "found cookie extension");
+          if (!is_hrr || ext_size < 3
+              || buf16_to_size_t (ext + 4) != ext_size - 2)
+            return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+          cookie = ext + 6;
+          cookie_len = ext_size - 2;
+          break;
+
+        default:
+          debug_msg (2, "unknown extension found: %d (ignoring)", ext_id);
+          break;
+        }
+
+      ext_len -= 4 + ext_size;
+      ext += 4 + ext_size;
+    }
+
+  if (is_hrr)
+    {
+      /* A second HelloRetryRequest and one which would not result
+       * in a different ClientHello are not allowed.  */
+      if (hs->hello_retry
+          || (!cookie && (!group || group == hs->key_share_group)))
+        {
+          debug_msg (1, "bad HelloRetryRequest");
+          return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+        }
+      if (group)
+        {
+          if (_ntbtls_ecdh_set_curve (hs->ecdh_ctx, group))
+            {
+              debug_msg (1, "HelloRetryRequest for unsupported group %u",
+                         group);
+              return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+            }
+          hs->key_share_group = group;
+        }
+      if (cookie)
+        {
+          hs->cookie = malloc (cookie_len);
+          if (!hs->cookie)
+            return gpg_error_from_syserror ();
+          memcpy (hs->cookie, cookie, cookie_len);
+          hs->cookie_len = cookie_len;
+        }
+
+      err = _ntbtls_tls13_hrr_checksum (tls, suite, tls->in_hslen);
+      if (err)
+        {
+          debug_ret (1, "tls13_hrr_checksum", err);
+          return err;
+        }
+
+      /* The early data has been rejected and the second ClientHello
+       * is sent in the clear.  The ticket can still be offered if it
+       * uses the hash of the selected ciphersuite.  */
+      if (hs->early_data_sent)
+        {
+          tls->transform_out = NULL;
+          tls->session_out = NULL;
+          memset (tls->out_ctr, 0, 8);
+          hs->early_data_sent = 0;
+        }
+      if (hs->psk_ticket
+          && ticket_hashlen (hs->psk_ticket) != suite_hashlen (suite))
+        {
+          _ntbtls_ticket_release (hs->psk_ticket);
+          hs->psk_ticket = NULL;
+        }
+
+      tls->transform_negotiate->ciphersuite = suite;
+      hs->hello_retry = 1;
+      tls->state = TLS_CLIENT_HELLO;
+      return 0;
+    }
+
+  if (!share || group != hs->key_share_group)
+    {
+      debug_msg (1, "server_hello without a matching key_share");
+      return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+
+  if (psk_selected)
+    {
+      /* The ciphersuite must use the hash of the ticket's session.  */
+      if (ticket_hashlen (hs->psk_ticket) != suite_hashlen (suite))
+        {
+          debug_msg (1, "server_hello selected PSK with a bad ciphersuite");
+          return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+        }
+      debug_msg (3, "server accepted the session ticket");
+      hs->psk_accepted = 1;
+
+      /* The server has been authenticated with the ticket's session.  */
+      tls->session_negotiate->peer_chain = hs->psk_ticket->peer_chain;
+      _ntbtls_x509_cert_ref (tls->session_negotiate->peer_chain);
+    }
+
+  memcpy (hs->randbytes + 32, buf + 6, 32);
+  debug_buf (3, "server_hello, random bytes", buf + 6, 32);
+
+  tls->transform_negotiate->ciphersuite = suite;
+  err = _ntbtls_optimize_checksum (tls, suite);
+  if (err)
+    {
+      debug_ret (1, "optimize_checksum", err);
+      return err;
+    }
+
+  err = _ntbtls_ecdh_read_point (hs->ecdh_ctx, share, share_len);
+  if (err)
+    {
+      debug_ret (1, "ecdh_read_point", err);
+      return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+  err = _ntbtls_ecdh_calc_secret (hs->ecdh_ctx,
+                                  hs->premaster, TLS_PREMASTER_SIZE,
+                                  &hs->pmslen);
+  if (err)
+    {
+      debug_ret (1, "ecdh_calc_secret", err);
+      return err;
+    }
+
+  hs->resume = 0;
+  tls->session_negotiate->start = time (NULL);
+  tls->session_negotiate->ciphersuite = suite_id;
+  tls->session_negotiate->compression = TLS_COMPRESS_NULL;
+
+  err = _ntbtls_tls13_derive_handshake_keys (tls);
+  if (err)
+    {
+      debug_ret (1, "tls13_derive_handshake_keys", err);
+      return err;
+    }
+
+  /* The session id was only used for middlebox compatibility.  */
+  tls->session_negotiate->length = 0;
+
+  tls->state = TLS_ENCRYPTED_EXTENSIONS;
+  return 0;
+}
+
+
 static gpg_error_t
 read_server_hello (ntbtls_t tls)
 {
   gpg_error_t err;
+  unsigned int version;
   int i, suite_id, comp;
   size_t n;
   size_t ext_len = 0;
@@ -804,7 +1558,39 @@ read_server_hello (ntbtls_t tls)
       return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
     }
 
-  if (buf[5] > tls->max_minor_ver)
+  /* A TLS 1.3 server announces its version only in the
+   * supported_versions extension (RFC 8446 4.1.3).  */
+  err = get_server_supported_version (tls, buf, &version);
+  if (err)
+    {
+      debug_msg (1, "bad server_hello message");
+      return err;
+    }
+  if (version)
+    {
+      if (version != ((TLS_MAJOR_VERSION_3 << 8) | TLS_MINOR_VERSION_4)
+          || !offer_tls13 (tls))
+        {
+          debug_msg (1, "server_hello selected unsupported version %04x",
+                     version);
+          return illegal_parameter (tls, GPG_ERR_UNSUPPORTED_PROTOCOL);
+        }
+      tls->minor_ver = TLS_MINOR_VERSION_4;
+      return read_server_hello_tls13 (tls);
+    }
+  if (tls->handshake->hello_retry)
+    {
+      debug_msg (1, "server_hello after HelloRetryRequest is not TLS 1.3");
+      return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+  if (tls->handshake->early_data_sent)
+    {
+      /* We can't take back the early data records (RFC 8446, D.3).  */
+      debug_msg (1, "server does not support TLS 1.3 but got early data");
+      return gpg_error (GPG_ERR_UNSUPPORTED_PROTOCOL);
+    }
+
+  if (buf[5] > TLS_LEGACY_MINOR_VERSION (tls->max_minor_ver))
     {
       debug_msg (1, "bad server_hello message");
       return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
@@ -824,6 +1610,16 @@ read_server_hello (ntbtls_t tls)
       return gpg_error (GPG_ERR_UNSUPPORTED_PROTOCOL);
     }
 
+  /* RFC 8446 4.1.3: A TLS 1.3 server negotiating an older version
+   * marks the end of its random; detect a downgrade attack.  */
+  if (offer_tls13 (tls)
+      && !memcmp (buf + 6 + 24, "DOWNGRD", 7)
+      && (buf[6 + 31] == 0x00 || buf[6 + 31] == 0x01))
+    {
+      debug_msg (1, "server_hello indicates a version downgrade");
+      return illegal_parameter (tls, GPG_ERR_UNSUPPORTED_PROTOCOL);
+    }
+
   t = buf32_to_u32 (buf+6);
   debug_msg (3, "server_hello, current time: %lu", (unsigned long)t);
 
@@ -871,7 +1667,12 @@ read_server_hello (ntbtls_t tls)
       return gpg_error (GPG_ERR_INV_ARG);
     }
 
-  _ntbtls_optimize_checksum (tls, tls->transform_negotiate->ciphersuite);
+  err = _ntbtls_optimize_checksum (tls, tls->transform_negotiate->ciphersuite);
+  if (err)
+    {
+      debug_ret (1, "optimize_checksum", err);
+      return err;
+    }
 
   debug_msg (3, "server_hello, session id len.: %zu", n);
   debug_buf (3, "server_hello, session id", buf + 39, n);
@@ -922,7 +1723,9 @@ read_server_hello (ntbtls_t tls)
         if (ciphersuites[i] == tls->session_negotiate->ciphersuite)
           break;
     }
-  if (!ciphersuites || !ciphersuites[i])
+  if (!ciphersuites || !ciphersuites[i]
+      || !_ntbtls_ciphersuite_version_ok (tls->transform_negotiate->ciphersuite,
+                                          tls->minor_ver, tls->minor_ver))
     {
       debug_msg (1, "bad server_hello message");
       return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
@@ -938,6 +1741,9 @@ read_server_hello (ntbtls_t tls)
 
   ext = buf + 44 + n;
 
+  /* Encrypt-then-MAC is only used if the server agrees again.  */
+  tls->session_negotiate->encrypt_then_mac = 0;
+
   debug_msg (2, "server_hello, total extension length: %zu", ext_len);
 
   while (ext_len)
@@ -975,6 +1781,13 @@ read_server_hello (ntbtls_t tls)
             return err;
           break;
 
+        case TLS_EXT_ENCRYPT_THEN_MAC:
+          debug_msg (2, "found encrypt_then_mac extension");
+          err = parse_encrypt_then_mac_ext (tls, ext + 4, ext_size);
+          if (err)
+            return err;
+          break;
+
         case TLS_EXT_SESSION_TICKET:
           debug_msg (2, "found session_ticket extension");
           err = parse_session_ticket_ext (tls, ext + 4, ext_size);
@@ -1162,7 +1975,7 @@ write_encrypted_pms (ntbtls_t tls,
    *  } PreMasterSecret;
    */
   p[0] = (unsigned char) tls->max_major_ver;
-  p[1] = (unsigned char) tls->max_minor_ver;
+  p[1] = (unsigned char) TLS_LEGACY_MINOR_VERSION (tls->max_minor_ver);
 
   gcry_randomize (p + 2, 46, GCRY_STRONG_RANDOM);
 
@@ -1199,16 +2012,19 @@ write_encrypted_pms (ntbtls_t tls,
 }
 
 
+/* Parse a SignatureAndHashAlgorithm or a TLS 1.3 SignatureScheme
+ * value at P.  For an RSASSA-PSS scheme R_PSS is set to true.  */
 static gpg_error_t
 parse_signature_algorithm (ntbtls_t tls, unsigned char **p, unsigned char *end,
-                           md_algo_t *md_alg, pk_algo_t *pk_alg)
+                           md_algo_t *md_alg, pk_algo_t *pk_alg, int *r_pss)
 {
 
   *md_alg = 0;
   *pk_alg = 0;
+  *r_pss = 0;
 
-  /* Only in TLS 1.2 */
-  if (tls->minor_ver != TLS_MINOR_VERSION_3)
+  /* Only in TLS 1.2 and later */
+  if (tls->minor_ver < TLS_MINOR_VERSION_3)
     {
       return 0;
     }
@@ -1216,6 +2032,21 @@ parse_signature_algorithm (ntbtls_t tls, unsigned char **p, unsigned char *end,
   if ((*p) + 2 > end)
     return gpg_error (GPG_ERR_BAD_HS_SERVER_KEX);
 
+  /*
+   * The rsa_pss_rsae_* schemes have the hash in the second octet.
+   */
+  if ((*p)[0] == TLS_SIG_RSA_PSS_RSAE
+      && (*p)[1] >= TLS_HASH_SHA256 && (*p)[1] <= TLS_HASH_SHA512)
+    {
+      *md_alg = _ntbtls_md_alg_from_hash ((*p)[1]);
+      *pk_alg = GCRY_PK_RSA;
+      *r_pss = 1;
+      debug_msg (2, "Server used RSASSA-PSS with %s",
+                 gcry_md_algo_name (*md_alg));
+      *p += 2;
+      return 0;
+    }
+
   /*
    * Get hash algorithm
    */
@@ -1292,7 +2123,7 @@ read_server_key_exchange (ntbtls_t tls)
   md_algo_t md_alg = 0;
   size_t hashlen;
   pk_algo_t pk_alg = 0;
-
+  int pss = 0;
 
   if (kex == KEY_EXCHANGE_RSA)
     {
@@ -1405,7 +2236,8 @@ read_server_key_exchange (ntbtls_t tls)
        */
       if (tls->minor_ver == TLS_MINOR_VERSION_3)
         {
-          err = parse_signature_algorithm (tls, &p, end, &md_alg, &pk_alg);
+          err = parse_signature_algorithm (tls, &p, end,
+                                           &md_alg, &pk_alg, &pss);
           if (err)
             {
               debug_msg (1, "bad server_key_exchange message (%d): %s",
@@ -1483,8 +2315,12 @@ read_server_key_exchange (ntbtls_t tls)
        * Verify signature
        */
 
-      err = _ntbtls_pk_verify (tls->session_negotiate->peer_chain,
-                               pk_alg, md_alg, hash, hashlen, p, sig_len);
+      if (pss)
+        err = _ntbtls_pk_verify_pss (tls->session_negotiate->peer_chain,
+                                     md_alg, hash, hashlen, p, sig_len);
+      else
+        err = _ntbtls_pk_verify (tls->session_negotiate->peer_chain,
+                                 pk_alg, md_alg, hash, hashlen, p, sig_len);
       debug_ret (1, "pk_verify", err);
       if (err)
         return err;
@@ -1673,6 +2509,330 @@ read_server_hello_done (ntbtls_t tls)
 }
 
 
+/* Read the TLS 1.3 EncryptedExtensions message.  */
+static gpg_error_t
+read_encrypted_extensions (ntbtls_t tls)
+{
+  gpg_error_t err;
+  unsigned char *ext;
+  size_t ext_len;
+
+  debug_msg (2, "read encrypted_extensions");
+
+  err = _ntbtls_read_record (tls);
+  if (err)
+    {
+      debug_ret (1, "read_record", err);
+      return err;
+    }
+
+  if (tls->in_msgtype != TLS_MSG_HANDSHAKE)
+    {
+      debug_msg (1, "bad encrypted_extensions message");
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+
+  /*
+   *     0  .   0   handshake type
+   *     1  .   3   handshake length
+   *     4  .   5   extensions length
+   *     6  . ...   extensions
+   */
+  if (tls->in_msg[0] != TLS_HS_ENCRYPTED_EXTENSIONS || tls->in_hslen < 6
+      || tls->in_hslen != 6 + buf16_to_size_t (tls->in_msg + 4))
+    {
+      debug_msg (1, "bad encrypted_extensions message");
+      return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+    }
+
+  ext_len = tls->in_hslen - 6;
+  ext = tls->in_msg + 6;
+  while (ext_len)
+    {
+      unsigned int ext_id, ext_size;
+
+      if (ext_len < 4
+          || (ext_size = buf16_to_uint (ext+2)) + 4 > ext_len)
+        {
+          debug_msg (1, "bad encrypted_extensions message");
+          return gpg_error (GPG_ERR_BAD_HS_SERVER_HELLO);
+        }
+      ext_id = buf16_to_uint (ext);
+
+      switch (ext_id)
+        {
+        case TLS_EXT_MAX_FRAGMENT_LENGTH:
+          debug_msg (2, "found max_fragment_length extension");
+          err = parse_max_fragment_length_ext (tls, ext + 4, ext_size);
+          if (err)
+            return err;
+          break;
+
+        case TLS_EXT_ALPN:
+          debug_msg (2, "found alpn extension");
+          err = parse_alpn_ext (tls, ext + 4, ext_size);
+          if (err)
+            return err;
+          break;
+
+        case TLS_EXT_EARLY_DATA:
+          debug_msg (2, "found early_data extension");
+          if (ext_size || !tls->handshake->early_data_sent
+              || !tls->handshake->psk_accepted)
+            return illegal_parameter (tls, GPG_ERR_BAD_HS_SERVER_HELLO);
+          tls->handshake->early_data_accepted = 1;
+          break;
+
+        default:
+          debug_msg (2, "unknown extension found: %d (ignoring)", ext_id);
+          break;
+        }
+
+      ext_len -= 4 + ext_size;
+      ext += 4 + ext_size;
+    }
+
+  if (tls->handshake->early_data_accepted)
+    {
+      debug_msg (3, "server accepted the early data");
+      free (tls->early_data);
+      tls->early_data = NULL;
+      tls->early_data_len = 0;
+    }
+  else if (tls->handshake->early_data_sent)
+    {
+      debug_msg (3, "server rejected the early data");
+      err = _ntbtls_tls13_end_early_data (tls);
+      if (err)
+        return err;
+    }
+
+  /* With a resumed session the server is not authenticated again.  */
+  if (tls->handshake->psk_accepted)
+    tls->state = TLS_SERVER_FINISHED;
+  else
+    tls->state = TLS_CERTIFICATE_REQUEST;
+
+  return 0;
+}
+
+
+/* Read an optional TLS 1.3 CertificateRequest.  */
+static gpg_error_t
+read_certificate_request_tls13 (ntbtls_t tls)
+{
+  gpg_error_t err;
+  unsigned char *buf = tls->in_msg;
+
+  debug_msg (2, "read certificate_request");
+
+  err = _ntbtls_read_record (tls);
+  if (err)
+    {
+      debug_ret (1, "read_record", err);
+      return err;
+    }
+
+  if (tls->in_msgtype != TLS_MSG_HANDSHAKE)
+    {
+      debug_msg (1, "bad certificate_request message");
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+
+  tls->client_auth = 0;
+  tls->state = TLS_SERVER_CERTIFICATE;
+
+  if (buf[0] != TLS_HS_CERTIFICATE_REQUEST)
+    {
+      /* This is the Certificate message.  */
+      tls->record_read = 1;
+      debug_msg (3, "got no certificate_request");
+      return 0;
+    }
+
+  /*
+   *     0  .   0   handshake type
+   *     1  .   3   handshake length
+   *     4  .   4   length of certificate_request_context (0)
+   *     5  .   6   extensions length
+   *     7  . ...   extensions
+   *
+   * We have no means to select a certificate by the signature
+   * algorithms or authorities and thus ignore the extensions.
+   */
+  if (tls->in_hslen < 7 || buf[4]
+      || tls->in_hslen != 7 + buf16_to_size_t (buf + 5))
+    {
+      debug_msg (1, "bad certificate_request message");
+      return gpg_error (GPG_ERR_BAD_HS_CERT_REQ);
+    }
+
+  tls->client_auth = 1;
+  debug_msg (3, "got a certificate_request");
+
+  return 0;
+}
+
+
+/* Read the TLS 1.3 CertificateVerify of the server.  */
+static gpg_error_t
+read_server_certificate_verify (ntbtls_t tls)
+{
+  static const char label[] = "TLS 1.3, server CertificateVerify";
+  gpg_error_t err;
+  unsigned char content[64 + sizeof label + 48];
+  unsigned char hash[64];
+  size_t thlen, hashlen, sig_len;
+  unsigned char *p, *end;
+  md_algo_t md_alg;
+  pk_algo_t pk_alg;
+  int pss;
+
+  debug_msg (2, "read certificate_verify");
+
+  /*
+   * The signature covers the transcript up to the Certificate:
+   *
+   *   64 spaces || context string || 0x00 || Transcript-Hash
+   *
+   * sizeof LABEL includes the 0x00.
+   */
+  memset (content, ' ', 64);
+  memcpy (content + 64, label, sizeof label);
+  err = _ntbtls_tls13_transcript_hash (tls, content + 64 + sizeof label,
+                                       &thlen);
+  if (err)
+    {
+      debug_ret (1, "tls13_transcript_hash", err);
+      return err;
+    }
+
+  err = _ntbtls_read_record (tls);
+  if (err)
+    {
+      debug_ret (1, "read_record", err);
+      return err;
+    }
+
+  if (tls->in_msgtype != TLS_MSG_HANDSHAKE)
+    {
+      debug_msg (1, "bad certificate_verify message");
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+
+  /*
+   *     0  .   0   handshake type
+   *     1  .   3   handshake length
+   *     4  .   5   SignatureScheme
+   *     6  .   7   signature length
+   *     8  . ...   signature
+   */
+  if (tls->in_msg[0] != TLS_HS_CERTIFICATE_VERIFY || tls->in_hslen < 8)
+    {
+      debug_msg (1, "bad certificate_verify message");
+      return gpg_error (GPG_ERR_BAD_HS_CERT_VER);
+    }
+
+  p = tls->in_msg + 4;
+  end = tls->in_msg + tls->in_hslen;
+  err = parse_signature_algorithm (tls, &p, end, &md_alg, &pk_alg, &pss);
+  if (err || (pk_alg == GCRY_PK_RSA && !pss))
+    {
+      /* RFC 8446 4.4.3: RSASSA-PKCS1-v1_5 is not allowed here.  */
+      debug_msg (1, "bad certificate_verify message: unsupported scheme");
+      return illegal_parameter (tls, GPG_ERR_BAD_HS_CERT_VER);
+    }
+
+  sig_len = buf16_to_size_t (p);
+  p += 2;
+  if (end != p + sig_len)
+    {
+      debug_msg (1, "bad certificate_verify message");
+      return gpg_error (GPG_ERR_BAD_HS_CERT_VER);
+    }
+
+  debug_buf (3, "signature", p, sig_len);
+
+  hashlen = gcry_md_get_algo_dlen (md_alg);
+  if (hashlen > sizeof hash)
+    return gpg_error (GPG_ERR_BUG);
+  gcry_md_hash_buffer (md_alg, hash, content, 64 + sizeof label + thlen);
+
+  if (pss)
+    err = _ntbtls_pk_verify_pss (tls->session_negotiate->peer_chain,
+                                 md_alg, hash, hashlen, p, sig_len);
+  else
+    err = _ntbtls_pk_verify (tls->session_negotiate->peer_chain,
+                             pk_alg, md_alg, hash, hashlen, p, sig_len);
+  if (err)
+    {
+      debug_ret (1, "pk_verify", err);
+      _ntbtls_send_alert_message (tls, TLS_ALERT_LEVEL_FATAL,
+                                  TLS_ALERT_MSG_DECRYPT_ERROR);
+      return err;
+    }
+
+  tls->state = TLS_SERVER_FINISHED;
+
+  return 0;
+}
+
+
+/* Send the EndOfEarlyData message after the server accepted our
+ * early data.  */
+static gpg_error_t
+write_end_of_early_data (ntbtls_t tls)
+{
+  gpg_error_t err;
+
+  debug_msg (2, "write end_of_early_data");
+
+  tls->out_msglen = 4;
+  tls->out_msgtype = TLS_MSG_HANDSHAKE;
+  tls->out_msg[0] = TLS_HS_END_OF_EARLY_DATA;
+
+  tls->state = TLS_CLIENT_FINISHED;
+
+  err = _ntbtls_write_record (tls);
+  if (err)
+    {
+      debug_ret (1, "write_record", err);
+      return err;
+    }
+
+  return _ntbtls_tls13_end_early_data (tls);
+}
+
+
+/* Send an empty TLS 1.3 Certificate in response to a
+ * CertificateRequest.  Client authentication is not yet supported
+ * with TLS 1.3; the server decides whether to continue.  */
+static gpg_error_t
+write_certificate_tls13 (ntbtls_t tls)
+{
+  gpg_error_t err;
+
+  debug_msg (2, "write certificate");
+  debug_msg (1, "no client certificate to send");
+
+  tls->out_msglen = 8;
+  tls->out_msgtype = TLS_MSG_HANDSHAKE;
+  tls->out_msg[0] = TLS_HS_CERTIFICATE;
+  memset (tls->out_msg + 4, 0, 4);
+
+  tls->state = TLS_CLIENT_FINISHED;
+
+  err = _ntbtls_write_record (tls);
+  if (err)
+    {
+      debug_ret (1, "write_record", err);
+      return err;
+    }
+
+  return 0;
+}
+
+
 static gpg_error_t
 write_client_key_exchange (ntbtls_t tls)
 {
@@ -2056,6 +3216,35 @@ parse_new_session_ticket (ntbtls_t tls)
 }
 
 
+/* Return true if application data may be sent right after our
+ * Finished (TLS False Start, RFC 7918).  This is only done if enabled
+ * with NTBTLS_FALSESTART and only for a full TLS 1.2 handshake with
+ * an ECDHE key exchange and an AEAD cipher.  */
+static int
+false_start_ok (ntbtls_t tls)
+{
+  ciphersuite_t suite = tls->transform_negotiate->ciphersuite;
+  key_exchange_type_t kex;
+  cipher_mode_t mode;
+
+  if (!(tls->flags & NTBTLS_FALSESTART)
+      || tls->handshake->resume
+      || tls->renegotiation != TLS_INITIAL_HANDSHAKE
+      || tls->minor_ver != TLS_MINOR_VERSION_3)
+    return 0;
+
+  kex = _ntbtls_ciphersuite_get_kex (suite);
+  if (kex != KEY_EXCHANGE_ECDHE_RSA && kex != KEY_EXCHANGE_ECDHE_ECDSA)
+    return 0;
+
+  if (!_ntbtls_ciphersuite_get_cipher (suite, &mode))
+    return 0;
+  return (mode == GCRY_CIPHER_MODE_GCM
+          || mode == GCRY_CIPHER_MODE_CCM
+          || mode == GCRY_CIPHER_MODE_POLY1305);
+}
+
+
 /*
  * SSL handshake -- client side -- single step
  */
@@ -2074,6 +3263,57 @@ _ntbtls_handshake_client_step (ntbtls_t tls)
   if (err)
     return err;
 
+  if (tls->minor_ver == TLS_MINOR_VERSION_4)
+    {
+      /*
+       *  <==   EncryptedExtensions
+       *      ( CertificateRequest )
+       *      ( Certificate       )  - not with a resumed session
+       *      ( CertificateVerify )  - not with a resumed session
+       *        Finished
+       *  ==> ( EndOfEarlyData )
+       *      ( Certificate )
+       *        Finished
+       */
+      switch (tls->state)
+        {
+        case TLS_ENCRYPTED_EXTENSIONS:
+          err = read_encrypted_extensions (tls);
+          return err;
+
+        case TLS_CERTIFICATE_REQUEST:
+          err = read_certificate_request_tls13 (tls);
+          return err;
+
+        case TLS_SERVER_CERTIFICATE:
+          err = _ntbtls_tls13_read_certificate (tls);
+          return err;
+
+        case TLS_SERVER_CERTIFICATE_VERIFY:
+          err = read_server_certificate_verify (tls);
+          return err;
+
+        case TLS_SERVER_FINISHED:
+          err = _ntbtls_tls13_read_finished (tls);
+          return err;
+
+        case TLS_END_OF_EARLY_DATA:
+          err = write_end_of_early_data (tls);
+          return err;
+
+        case TLS_CLIENT_CERTIFICATE:
+          err = write_certificate_tls13 (tls);
+          return err;
+
+        case TLS_CLIENT_FINISHED:
+          err = _ntbtls_tls13_write_finished (tls);
+          return err;
+
+        default: /* The states shared with TLS 1.2.  */
+          break;
+        }
+    }
+
   switch (tls->state)
     {
     case TLS_HELLO_REQUEST:
@@ -2139,6 +3379,12 @@ _ntbtls_handshake_client_step (ntbtls_t tls)
 
     case TLS_CLIENT_FINISHED:
       err = _ntbtls_write_finished (tls);
+      if (!err && tls->state == TLS_SERVER_CHANGE_CIPHER_SPEC
+          && false_start_ok (tls))
+        {
+          debug_msg (2, "false start allowed");
+          tls->handshake->false_start = 1;
+        }
       break;
 
       /*
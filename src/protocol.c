@@ -26,6 +26,14 @@
 #include <config.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_KEY_CREATE)
+# include <pthread.h>
+# define USE_RECBUF_CACHE 1
+#endif
 
 #include "ntbtls-int.h"
 #include "ciphersuites.h"
@@ -37,13 +45,68 @@ static void session_deinit (session_t session);
 static void handshake_params_deinit (handshake_params_t handshake);
 static void ticket_keys_deinit (ticket_keys_t tkeys);
 
-static void update_checksum_sha256 (ntbtls_t, const unsigned char *, size_t);
+static gpg_error_t write_pending_early_data (ntbtls_t tls);
+static gpg_error_t process_certificate_list (ntbtls_t tls,
+                                             const unsigned char *list,
+                                             size_t listlen);
+static void update_checksum_md (ntbtls_t, const unsigned char *, size_t);
 static void calc_verify_tls_sha256 (ntbtls_t, unsigned char *);
 static void calc_finished_tls_sha256 (ntbtls_t, unsigned char *, int);
 static void calc_verify_tls_sha384 (ntbtls_t, unsigned char *);
 static void calc_finished_tls_sha384 (ntbtls_t, unsigned char *, int);
 
 
+/* Check the memory figures of a connection after the handshake as
+ * documented at struct _ntbtls_context_s in context.h.  The build
+ * fails if they drift; update the comment there and the numbers
+ * here.  The sizes are only checked for x86_64.  */
+#if defined(__x86_64__) && defined(__LP64__)
+# define MEMSIZE_CHECK(name, expr) \
+  typedef char memsize_check_ ## name [(expr)? 1 : -1]
+MEMSIZE_CHECK (context, sizeof (struct _ntbtls_context_s) == 832);
+MEMSIZE_CHECK (session, sizeof (struct _ntbtls_session_s) == 152);
+MEMSIZE_CHECK (transform, sizeof (struct _ntbtls_transform_s) == 512);
+MEMSIZE_CHECK (buffer, TLS_BUFFER_LEN == 17741);
+MEMSIZE_CHECK (total, (sizeof (struct _ntbtls_context_s)
+                       + sizeof (struct _ntbtls_session_s)
+                       + sizeof (struct _ntbtls_transform_s)
+                       + 2 * TLS_BUFFER_LEN) == 36978);
+# undef MEMSIZE_CHECK
+#endif /*__x86_64__*/
+
+
+/* The maximum number of record buffers kept in the pool.  */
+#define RECBUF_POOL_MAX 64
+
+/* A pool of free record buffers of TLS_BUFFER_LEN bytes shared by
+ * all contexts.  The buffers are linked via their first bytes; they
+ * are pushed and popped at the head so that a recently released
+ * buffer, which is likely still cached, is handed out first.  COUNT
+ * is only valid for the head of a per-thread cache list.  */
+struct recbuf_s
+{
+  struct recbuf_s *next;
+  unsigned int count;
+};
+static struct recbuf_s *recbuf_pool;
+static unsigned int recbuf_pool_count;
+
+/* The lock to protect RECBUF_POOL.  */
+GPGRT_LOCK_DEFINE (recbuf_pool_lock);
+
+#ifdef USE_RECBUF_CACHE
+/* The maximum number of record buffers kept by each thread in front
+ * of the pool; this is enough for two contexts being closed and
+ * opened in turn.  The list head is stored as thread specific value
+ * so that the cache is accessed without a lock and is returned to
+ * the pool when the thread terminates.  */
+#define RECBUF_CACHE_MAX 4
+static pthread_once_t recbuf_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t recbuf_cache_key;
+static int recbuf_cache_ok;
+#endif /*USE_RECBUF_CACHE*/
+
+
 static const char *
 alert_msg_to_string (int msgno)
 {
@@ -76,6 +139,7 @@ alert_msg_to_string (int msgno)
     case TLS_ALERT_MSG_UNSUPPORTED_EXT:    return "unsupported extenstion";
     case TLS_ALERT_MSG_UNRECOGNIZED_NAME:  return "unsupported name";
     case TLS_ALERT_MSG_UNKNOWN_PSK_IDENTITY:   return "unknown PSK identify";
+    case TLS_ALERT_MSG_CERT_REQUIRED:      return "cert required";
     case TLS_ALERT_MSG_NO_APPLICATION_PROTOCOL:return "no application protocol";
     default: return "[?]";
     }
@@ -109,6 +173,7 @@ is_aead_mode (cipher_mode_t mode)
     {
     case GCRY_CIPHER_MODE_GCM:
     case GCRY_CIPHER_MODE_CCM:
+    case GCRY_CIPHER_MODE_POLY1305:
       return 1;
     default:
       return 0;
@@ -141,6 +206,9 @@ _ntbtls_state2str (tls_state_t state)
     case TLS_HANDSHAKE_WRAPUP:          s = "handshake_wrapup"; break;
     case TLS_HANDSHAKE_OVER:            s = "handshake_over"; break;
     case TLS_SERVER_NEW_SESSION_TICKET: s = "server_new_session_tickets"; break;
+    case TLS_ENCRYPTED_EXTENSIONS:      s = "encrypted_extensions"; break;
+    case TLS_SERVER_CERTIFICATE_VERIFY: s = "server_certificate_verify"; break;
+    case TLS_END_OF_EARLY_DATA:         s = "end_of_early_data"; break;
     }
   return s;
 }
@@ -189,40 +257,25 @@ session_copy (session_t dst, const session_t src)
 /*
  * output = HMAC-SHA-NNN( hmac key, input buffer )
  *
- * The used algorithm depends on OUTPUTSIZE which is expected in bytes.
+ * HD is an HMAC handle with the key already set; it is reset before
+ * use so that the key schedule is computed only once for all
+ * invocations.  OUTPUTSIZE is the length of the HMAC in bytes.
  */
 static gpg_error_t
-sha_hmac (const unsigned char *key, size_t keylen,
+sha_hmac (gcry_mac_hd_t hd,
           const unsigned char *input, size_t inputlen,
           unsigned char *output, int outputsize)
 {
   gpg_error_t err;
-  gcry_mac_hd_t hd;
   size_t macoutlen;
-  int algo;
-
-  switch (outputsize)
-    {
-    case 32: algo = GCRY_MAC_HMAC_SHA256; break;
-    case 48: algo = GCRY_MAC_HMAC_SHA384; break;
-    case 64: algo = GCRY_MAC_HMAC_SHA512; break;
-    default: return gpg_error (GPG_ERR_MAC_ALGO);
-    }
 
-  err = gcry_mac_open (&hd, algo, 0, NULL);
+  err = gcry_mac_reset (hd);
+  if (!err)
+    err = gcry_mac_write (hd, input, inputlen);
   if (!err)
     {
-      err = gcry_mac_setkey (hd, key, keylen);
-      if (!err)
-        {
-          err = gcry_mac_write (hd, input, inputlen);
-          if (!err)
-            {
-              macoutlen = outputsize;
-              err = gcry_mac_read (hd, output, &macoutlen);
-            }
-        }
-      gcry_mac_close (hd);
+      macoutlen = outputsize;
+      err = gcry_mac_read (hd, output, &macoutlen);
     }
   return err;
 }
@@ -240,14 +293,31 @@ do_tls_prf (const unsigned char *secret, size_t slen,
             size_t hashlen)
 {
   gpg_error_t err;
+  gcry_mac_hd_t hd;
   size_t nb;
   size_t i, j, k;
   unsigned char tmp[128];
   unsigned char h_i[64];
+  int algo;
 
   if (sizeof (tmp) < hashlen + strlen (label) + rlen)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  switch (hashlen)
+    {
+    case 32: algo = GCRY_MAC_HMAC_SHA256; break;
+    case 48: algo = GCRY_MAC_HMAC_SHA384; break;
+    case 64: algo = GCRY_MAC_HMAC_SHA512; break;
+    default: return gpg_error (GPG_ERR_MAC_ALGO);
+    }
+
+  err = gcry_mac_open (&hd, algo, 0, NULL);
+  if (err)
+    return err;
+  err = gcry_mac_setkey (hd, secret, slen);
+  if (err)
+    goto leave;
+
   nb = strlen (label);
   memcpy (tmp + hashlen, label, nb);
   memcpy (tmp + hashlen + nb, random, rlen);
@@ -256,18 +326,18 @@ do_tls_prf (const unsigned char *secret, size_t slen,
   /*
    * Compute P_<hash>(secret, label + random)[0..dlen]
    */
-  err = sha_hmac (secret, slen, tmp + hashlen, nb, tmp, hashlen);
+  err = sha_hmac (hd, tmp + hashlen, nb, tmp, hashlen);
   if (err)
-    return err;
+    goto leave;
 
   for (i = 0; i < dlen; i += hashlen)
     {
-      err = sha_hmac (secret, slen, tmp, hashlen + nb, h_i, hashlen);
+      err = sha_hmac (hd, tmp, hashlen + nb, h_i, hashlen);
       if (err)
-        return err;
-      err = sha_hmac (secret, slen, tmp, hashlen, tmp, hashlen);
+        goto leave;
+      err = sha_hmac (hd, tmp, hashlen, tmp, hashlen);
       if (err)
-        return err;
+        goto leave;
 
       k = (i + hashlen > dlen) ? dlen % hashlen : hashlen;
 
@@ -275,10 +345,12 @@ do_tls_prf (const unsigned char *secret, size_t slen,
         dstbuf[i + j] = h_i[j];
     }
 
+ leave:
+  gcry_mac_close (hd);
   wipememory (tmp, sizeof (tmp));
   wipememory (h_i, hashlen);
 
-  return 0;
+  return err;
 }
 
 
@@ -308,6 +380,7 @@ _ntbtls_derive_keys (ntbtls_t tls)
   gpg_error_t err;
   unsigned char tmp[64];
   unsigned char keyblk[256];
+  size_t keyblklen;
   unsigned char *key1;
   unsigned char *key2;
   unsigned char *mac_enc;
@@ -385,22 +458,6 @@ _ntbtls_derive_keys (ntbtls_t tls)
   memcpy (handshake->randbytes + 32, tmp, 32);
   wipememory (tmp, sizeof (tmp));
 
-  /*
-   *  TLSv1:
-   *    key block = PRF( master, "key expansion", randbytes )
-   */
-  handshake->tls_prf (session->master, 48,
-                      "key expansion",
-                      handshake->randbytes, 64, keyblk, 256);
-
-  debug_msg (3, "ciphersuite = %s",
-             _ntbtls_ciphersuite_get_name (session->ciphersuite));
-  debug_buf (3, "master secret", session->master, 48);
-  debug_buf (4, "random bytes", handshake->randbytes, 64);
-  debug_buf (4, "key block", keyblk, 256);
-
-  wipememory (handshake->randbytes, sizeof (handshake->randbytes));
-
   /*
    * Determine the appropriate key, IV and MAC length.
    */
@@ -409,7 +466,18 @@ _ntbtls_derive_keys (ntbtls_t tls)
   /* FIXME: Check that KEYLEN has an upper bound.
             2015-06-23 wk: Why? */
 
-  if (is_aead_mode (ciphermode))
+  if (ciphermode == GCRY_CIPHER_MODE_POLY1305)
+    {
+      /* RFC 7905: The entire 12 byte nonce is derived from the key
+       * block and the sequence number; there is no explicit IV.  */
+      transform->maclen = 0;
+
+      transform->ivlen = 12;
+      transform->fixed_ivlen = 12;
+
+      transform->minlen = 16;
+    }
+  else if (is_aead_mode (ciphermode))
     {
       transform->maclen = 0;
 
@@ -474,6 +542,39 @@ _ntbtls_derive_keys (ntbtls_t tls)
              transform->keylen, transform->minlen, transform->ivlen,
              transform->maclen);
 
+  /*
+   *  TLSv1:
+   *    key block = PRF( master, "key expansion", randbytes )
+   *
+   * We derive only as many bytes as needed for the two MAC keys,
+   * the two cipher keys and the two IVs.
+   */
+  iv_copy_len = (transform->fixed_ivlen ?
+                 transform->fixed_ivlen : transform->ivlen);
+  keyblklen = 2 * (transform->maclen + transform->keylen + iv_copy_len);
+  if (keyblklen > sizeof keyblk)
+    {
+      debug_bug ();
+      return gpg_error (GPG_ERR_BUG);
+    }
+
+  err = handshake->tls_prf (session->master, 48,
+                            "key expansion",
+                            handshake->randbytes, 64, keyblk, keyblklen);
+  if (err)
+    {
+      debug_ret (1, "tls_prf", err);
+      return err;
+    }
+
+  debug_msg (3, "ciphersuite = %s",
+             _ntbtls_ciphersuite_get_name (session->ciphersuite));
+  debug_buf (3, "master secret", session->master, 48);
+  debug_buf (4, "random bytes", handshake->randbytes, 64);
+  debug_buf (4, "key block", keyblk, keyblklen);
+
+  wipememory (handshake->randbytes, sizeof (handshake->randbytes));
+
   /*
    * Finally setup the cipher contexts, IVs and MAC secrets.
    */
@@ -488,8 +589,6 @@ _ntbtls_derive_keys (ntbtls_t tls)
       /*
        * This is not used in TLS v1.1.  FIXME: Check and remove.
        */
-      iv_copy_len = (transform->fixed_ivlen ?
-                     transform->fixed_ivlen : transform->ivlen);
       memcpy (transform->iv_enc, key2 + transform->keylen, iv_copy_len);
       memcpy (transform->iv_dec, key2 + transform->keylen + iv_copy_len,
               iv_copy_len);
@@ -505,8 +604,6 @@ _ntbtls_derive_keys (ntbtls_t tls)
       /*
        * This is not used in TLS v1.1.  FIXME: Check and remove
        */
-      iv_copy_len = (transform->fixed_ivlen ?
-                     transform->fixed_ivlen : transform->ivlen);
       memcpy (transform->iv_dec, key1 + transform->keylen, iv_copy_len);
       memcpy (transform->iv_enc, key1 + transform->keylen + iv_copy_len,
               iv_copy_len);
@@ -553,6 +650,14 @@ _ntbtls_derive_keys (ntbtls_t tls)
       return err;
     }
 
+  /* The kernel needs the keys for NTBTLS_KTLS.  */
+  if ((tls->flags & NTBTLS_KTLS) && is_aead_mode (ciphermode)
+      && transform->keylen <= sizeof transform->ktls_key_enc)
+    {
+      memcpy (transform->ktls_key_enc, key1, transform->keylen);
+      memcpy (transform->ktls_key_dec, key2, transform->keylen);
+    }
+
   wipememory (keyblk, sizeof (keyblk));
 
   /* Initialize compression.  */
@@ -598,6 +703,13 @@ calc_verify_tls (gcry_md_hd_t md_input, md_algo_t md_alg,
 
   debug_msg (2, "calc_verify_tls sha%zu", hashlen*8);
 
+  if (!md_input)
+    {
+      debug_bug ();
+      memset (hash, 0, hashlen);
+      return;
+    }
+
   err = gcry_md_copy (&md, md_input);
   if (err)
     {
@@ -624,13 +736,13 @@ calc_verify_tls (gcry_md_hd_t md_input, md_algo_t md_alg,
 static void
 calc_verify_tls_sha256 (ntbtls_t tls, unsigned char hash[32])
 {
-  calc_verify_tls (tls->handshake->fin_sha256, GCRY_MD_SHA256, hash, 32);
+  calc_verify_tls (tls->handshake->fin_md, GCRY_MD_SHA256, hash, 32);
 }
 
 static void
 calc_verify_tls_sha384 (ntbtls_t tls, unsigned char hash[48])
 {
-  calc_verify_tls (tls->handshake->fin_sha512, GCRY_MD_SHA384, hash, 48);
+  calc_verify_tls (tls->handshake->fin_md, GCRY_MD_SHA384, hash, 48);
 }
 
 
@@ -728,12 +840,135 @@ _ntbtls_psk_derive_premaster (ntbtls_t tls, key_exchange_type_t kex)
 /*
  * Encryption/decryption functions
  */
+
+/* CCM requires that the lengths of the data are known before the
+ * encryption starts.  Pass the length of the message MSGLEN, of the
+ * 13 bytes of additional data and the TAGLEN to the cipher handle
+ * HD.  */
+static gpg_error_t
+set_ccm_lengths (gcry_cipher_hd_t hd, size_t msglen, size_t taglen)
+{
+  uint64_t params[3];
+
+  params[0] = msglen;
+  params[1] = 13;
+  params[2] = taglen;
+  return gcry_cipher_ctl (hd, GCRYCTL_SET_CCM_LENGTHS, params, sizeof params);
+}
+
+
+/* Build the 12 byte AEAD nonce at NONCE from the FIXED_IVLEN bytes
+ * of FIXED_IV and the 8 byte value SEQ.  With a 4 byte fixed part
+ * (GCM, CCM) SEQ is the explicit nonce which is appended.  With a 12
+ * byte fixed part (RFC 7905) SEQ is the sequence number which is
+ * XORed into the last 8 bytes of the fixed IV.  */
+static void
+make_aead_nonce (unsigned char nonce[12], const unsigned char *fixed_iv,
+                 size_t fixed_ivlen, const unsigned char *seq)
+{
+  int i;
+
+  if (fixed_ivlen == 12)
+    {
+      memcpy (nonce, fixed_iv, 12);
+      for (i = 0; i < 8; i++)
+        nonce[4 + i] ^= seq[i];
+    }
+  else
+    {
+      memcpy (nonce, fixed_iv, fixed_ivlen);
+      memcpy (nonce + fixed_ivlen, seq, 8);
+    }
+}
+
+
+/* Compute the encrypt-then-MAC value (RFC 7366) using the MAC handle
+ * HD over the sequence number SEQ, a record header of type MSGTYPE
+ * and length LEN, and the LEN bytes of IV and ciphertext at DATA.
+ * The MAC is stored at MAC which must have room for MACLEN bytes.  */
+static gpg_error_t
+etm_mac (ntbtls_t tls, gcry_mac_hd_t hd, const unsigned char *seq,
+         int msgtype, const unsigned char *data, size_t len,
+         unsigned char *mac, size_t maclen)
+{
+  gpg_error_t err;
+  unsigned char add_data[13];
+
+  memcpy (add_data, seq, 8);
+  add_data[8] = msgtype;
+  add_data[9] = tls->major_ver;
+  add_data[10] = tls->minor_ver;
+  add_data[11] = (len >> 8) & 0xFF;
+  add_data[12] = len & 0xFF;
+
+  err = gcry_mac_write (hd, add_data, 13);
+  if (!err)
+    err = gcry_mac_write (hd, data, len);
+  if (!err)
+    err = gcry_mac_read (hd, mac, &maclen);
+  if (!err)
+    err = gcry_mac_reset (hd);
+  return err;
+}
+
+
+/* Protect a TLS 1.3 record (RFC 8446, 5.2).  The real content type
+ * is appended to the plaintext, no padding is added, and the record
+ * is sent as application data.  The additional data is the record
+ * header and the nonce is the IV XORed with the sequence number.  */
+static gpg_error_t
+encrypt_tls13 (ntbtls_t tls)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t hd = tls->transform_out->cipher_ctx_enc;
+  unsigned char add_data[5];
+  unsigned char iv[12];
+  size_t enc_msglen;
+
+  tls->out_msg[tls->out_msglen] = tls->out_msgtype;
+  enc_msglen = tls->out_msglen + 1;
+  tls->out_msglen = enc_msglen + 16;
+
+  tls->out_hdr[0] = TLS_MSG_APPLICATION_DATA;
+  add_data[0] = TLS_MSG_APPLICATION_DATA;
+  add_data[1] = tls->out_hdr[1];
+  add_data[2] = tls->out_hdr[2];
+  add_data[3] = (tls->out_msglen >> 8) & 0xFF;
+  add_data[4] = tls->out_msglen & 0xFF;
+
+  make_aead_nonce (iv, tls->transform_out->iv_enc, 12, tls->out_ctr);
+
+  debug_buf (4, "additional data used for AEAD", add_data, 5);
+  debug_buf (4, "IV used", iv, 12);
+  debug_buf (4, "before encrypt: output payload", tls->out_msg, enc_msglen);
+
+  err = gcry_cipher_reset (hd);
+  if (!err)
+    err = gcry_cipher_setiv (hd, iv, 12);
+  if (!err)
+    err = gcry_cipher_authenticate (hd, add_data, 5);
+  if (!err)
+    err = gcry_cipher_encrypt (hd, tls->out_msg, enc_msglen, NULL, 0);
+  if (!err)
+    err = gcry_cipher_gettag (hd, tls->out_msg + enc_msglen, 16);
+  if (err)
+    {
+      debug_ret (1, "encrypt_tls13", err);
+      return err;
+    }
+
+  return 0;
+}
+
+
 static gpg_error_t
 encrypt_buf (ntbtls_t tls)
 {
   gpg_error_t err;
   size_t tmplen, i;
   cipher_mode_t mode = tls->transform_out->cipher_mode_enc;
+  int etm = (mode == GCRY_CIPHER_MODE_CBC
+             && tls->session_out && tls->session_out->encrypt_then_mac);
 
   debug_msg (2, "encrypt buf");
 
@@ -745,9 +980,9 @@ encrypt_buf (ntbtls_t tls)
 
 
   /*
-   * Add MAC before encrypt, except for AEAD modes
+   * Add MAC before encrypt, except for AEAD modes and encrypt-then-MAC
    */
-  if (!is_aead_mode (mode))
+  if (!is_aead_mode (mode) && !etm)
     {
       err = gcry_mac_write (tls->transform_out->mac_ctx_enc,
                             tls->out_ctr, 13);
@@ -778,7 +1013,13 @@ encrypt_buf (ntbtls_t tls)
   /*
    * Encrypt
    */
-  if (is_aead_mode (mode))
+  if (tls->minor_ver == TLS_MINOR_VERSION_4)
+    {
+      err = encrypt_tls13 (tls);
+      if (err)
+        return err;
+    }
+  else if (is_aead_mode (mode))
     {
       size_t enc_msglen;
       unsigned char *enc_msg;
@@ -802,9 +1043,10 @@ encrypt_buf (ntbtls_t tls)
       /*
        * Generate IV
        */
-      memcpy (iv, tls->transform_out->iv_enc, tls->transform_out->fixed_ivlen);
-      memcpy (iv + tls->transform_out->fixed_ivlen, tls->out_ctr, 8);
-      memcpy (tls->out_iv, tls->out_ctr, 8);
+      make_aead_nonce (iv, tls->transform_out->iv_enc,
+                       tls->transform_out->fixed_ivlen, tls->out_ctr);
+      if (tls->transform_out->fixed_ivlen < tls->transform_out->ivlen)
+        memcpy (tls->out_iv, tls->out_ctr, 8);
 
       debug_buf (4, "IV used (internal)", iv, tls->transform_out->ivlen);
       debug_buf (4, "IV used (transmitted)", tls->out_iv,
@@ -836,6 +1078,16 @@ encrypt_buf (ntbtls_t tls)
           debug_ret (1, "cipher_setiv", err);
           return err;
         }
+      if (mode == GCRY_CIPHER_MODE_CCM)
+        {
+          err = set_ccm_lengths (tls->transform_out->cipher_ctx_enc,
+                                 enc_msglen, taglen);
+          if (err)
+            {
+              debug_ret (1, "set_ccm_lengths", err);
+              return err;
+            }
+        }
 
       /*
        * Encrypt and authenticate
@@ -931,6 +1183,26 @@ encrypt_buf (ntbtls_t tls)
           debug_ret (1, "cipher_encrypt", err);
           return err;
         }
+
+      if (etm)
+        {
+          /* The MAC covers the IV and the ciphertext.  */
+          err = etm_mac (tls, tls->transform_out->mac_ctx_enc,
+                         tls->out_ctr, tls->out_msgtype,
+                         tls->out_iv, tls->out_msglen,
+                         tls->out_iv + tls->out_msglen,
+                         tls->transform_out->maclen);
+          if (err)
+            {
+              debug_ret (1, "encrypt_buf: MACing failed", err);
+              return err;
+            }
+
+          debug_buf (4, "computed mac", tls->out_iv + tls->out_msglen,
+                     tls->transform_out->maclen);
+
+          tls->out_msglen += tls->transform_out->maclen;
+        }
     }
   else
     {
@@ -953,11 +1225,164 @@ encrypt_buf (ntbtls_t tls)
 }
 
 
+/* Check and decrypt a CBC record protected with encrypt-then-MAC
+ * (RFC 7366).  The MAC is verified before anything is decrypted; thus
+ * the padding check does not need to run in constant time.  On
+ * success IN_MSGLEN and the length in IN_HDR are set to the length
+ * of the plaintext.  */
+static gpg_error_t
+decrypt_cbc_etm (ntbtls_t tls)
+{
+  gpg_error_t err;
+  transform_t transform = tls->transform_in;
+  unsigned char mac[TLS_MAX_MAC_SIZE];
+  unsigned char *dec_msg;
+  size_t len, dec_msglen, padlen, i;
+
+  if (tls->in_msglen < 2 * transform->ivlen + transform->maclen)
+    {
+      debug_msg (1, "msglen (%zu) < 2 * ivlen (%zu) + maclen (%zu)",
+                 tls->in_msglen, transform->ivlen, transform->maclen);
+      return gpg_error (GPG_ERR_INV_MAC);
+    }
+
+  /* LEN is the length of the IV and the ciphertext.  */
+  len = tls->in_msglen - transform->maclen;
+  if ((len % transform->ivlen))
+    {
+      debug_msg (1, "msglen (%zu) %% ivlen (%zu) != 0",
+                 len, transform->ivlen);
+      return gpg_error (GPG_ERR_INV_MAC);
+    }
+
+  err = etm_mac (tls, transform->mac_ctx_dec, tls->in_ctr, tls->in_msgtype,
+                 tls->in_iv, len, mac, transform->maclen);
+  if (err)
+    {
+      debug_ret (1, "decrypt_buf: MACing failed", err);
+      return err;
+    }
+
+  debug_buf (4, "message  mac", tls->in_iv + len, transform->maclen);
+  debug_buf (4, "computed mac", mac, transform->maclen);
+
+  if (memcmpct (mac, tls->in_iv + len, transform->maclen))
+    {
+      debug_msg (1, "message mac does not match");
+      return gpg_error (GPG_ERR_BAD_MAC);
+    }
+
+  dec_msg = tls->in_msg;
+  dec_msglen = len - transform->ivlen;
+
+  err = gcry_cipher_reset (transform->cipher_ctx_dec);
+  if (err)
+    {
+      debug_ret (1, "cipher_reset", err);
+      return err;
+    }
+  err = gcry_cipher_setiv (transform->cipher_ctx_dec,
+                           tls->in_iv, transform->ivlen);
+  if (err)
+    {
+      debug_ret (1, "cipher_setiv", err);
+      return err;
+    }
+  err = gcry_cipher_decrypt (transform->cipher_ctx_dec,
+                             dec_msg, dec_msglen, NULL, 0);
+  if (err)
+    {
+      debug_ret (1, "cipher_decrypt", err);
+      return err;
+    }
+
+  padlen = dec_msg[dec_msglen - 1];
+  if (padlen + 1 > dec_msglen)
+    {
+      debug_msg (1, "msglen (%zu) < padlen (%zu) + 1", dec_msglen, padlen);
+      return gpg_error (GPG_ERR_BAD_MAC);
+    }
+  for (i = dec_msglen - padlen - 1; i < dec_msglen; i++)
+    if (dec_msg[i] != padlen)
+      {
+        debug_msg (1, "bad padding byte detected");
+        return gpg_error (GPG_ERR_BAD_MAC);
+      }
+
+  tls->in_msglen = dec_msglen - padlen - 1;
+  tls->in_hdr[3] = (unsigned char) (tls->in_msglen >> 8);
+  tls->in_hdr[4] = (unsigned char) (tls->in_msglen);
+
+  return 0;
+}
+
+
+/* Check and decrypt a TLS 1.3 record.  On success the padding has
+ * been stripped and IN_MSGTYPE, IN_MSGLEN and the length in IN_HDR
+ * describe the inner plaintext.  */
+static gpg_error_t
+decrypt_tls13 (ntbtls_t tls)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t hd = tls->transform_in->cipher_ctx_dec;
+  unsigned char iv[12];
+  size_t dec_msglen;
+
+  if (tls->in_msgtype != TLS_MSG_APPLICATION_DATA)
+    {
+      debug_msg (1, "unprotected record of type %d", tls->in_msgtype);
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+
+  /* IN_MSGLEN is at least MINLEN; i.e. the tag and one byte.  */
+  dec_msglen = tls->in_msglen - 16;
+
+  make_aead_nonce (iv, tls->transform_in->iv_dec, 12, tls->in_ctr);
+
+  debug_buf (4, "IV used", iv, 12);
+  debug_buf (4, "TAG used", tls->in_msg + dec_msglen, 16);
+
+  err = gcry_cipher_reset (hd);
+  if (!err)
+    err = gcry_cipher_setiv (hd, iv, 12);
+  if (!err)
+    err = gcry_cipher_authenticate (hd, tls->in_hdr, 5);
+  if (!err)
+    err = gcry_cipher_decrypt (hd, tls->in_msg, dec_msglen, NULL, 0);
+  if (!err)
+    err = gcry_cipher_checktag (hd, tls->in_msg + dec_msglen, 16);
+  if (err)
+    {
+      debug_ret (1, "decrypt_tls13", err);
+      return err;
+    }
+
+  /* Strip the padding; the last non-zero byte is the content type.  */
+  while (dec_msglen && !tls->in_msg[dec_msglen - 1])
+    dec_msglen--;
+  if (!dec_msglen)
+    {
+      debug_msg (1, "record without content type");
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+  dec_msglen--;
+
+  tls->in_msgtype = tls->in_msg[dec_msglen];
+  tls->in_msglen = dec_msglen;
+  tls->in_hdr[3] = (unsigned char) (tls->in_msglen >> 8);
+  tls->in_hdr[4] = (unsigned char) (tls->in_msglen);
+
+  return 0;
+}
+
+
 static int
 decrypt_buf (ntbtls_t tls)
 {
   gpg_error_t err;
-  cipher_mode_t mode = tls->transform_out->cipher_mode_dec;
+  cipher_mode_t mode = tls->transform_in->cipher_mode_dec;
+  int etm = (mode == GCRY_CIPHER_MODE_CBC
+             && tls->session_in && tls->session_in->encrypt_then_mac);
   size_t padlen = 0;
   size_t correct = 1;
   size_t tmplen, i;
@@ -977,7 +1402,13 @@ decrypt_buf (ntbtls_t tls)
       return gpg_error (GPG_ERR_INV_MAC);
     }
 
-  if (is_aead_mode (mode))
+  if (tls->minor_ver == TLS_MINOR_VERSION_4)
+    {
+      err = decrypt_tls13 (tls);
+      if (err)
+        return err;
+    }
+  else if (is_aead_mode (mode))
     {
       size_t dec_msglen;
       unsigned char *dec_msg;
@@ -1011,8 +1442,10 @@ decrypt_buf (ntbtls_t tls)
 
       debug_buf (4, "additional data used for AEAD", add_data, 13);
 
-      memcpy (iv, tls->transform_in->iv_dec, tls->transform_in->fixed_ivlen);
-      memcpy (iv + tls->transform_in->fixed_ivlen, tls->in_iv, 8);
+      make_aead_nonce (iv, tls->transform_in->iv_dec,
+                       tls->transform_in->fixed_ivlen,
+                       (tls->transform_in->fixed_ivlen
+                        < tls->transform_in->ivlen)? tls->in_iv : tls->in_ctr);
 
       debug_buf (4, "IV used", iv, 12);
       debug_buf (4, "TAG used", dec_msg + dec_msglen, taglen);
@@ -1033,6 +1466,16 @@ decrypt_buf (ntbtls_t tls)
           debug_ret (1, "cipher_setiv", err);
           return err;
         }
+      if (mode == GCRY_CIPHER_MODE_CCM)
+        {
+          err = set_ccm_lengths (tls->transform_in->cipher_ctx_dec,
+                                 dec_msglen, taglen);
+          if (err)
+            {
+              debug_ret (1, "set_ccm_lengths", err);
+              return err;
+            }
+        }
 
       err = gcry_cipher_authenticate (tls->transform_in->cipher_ctx_dec,
                                       add_data, 13);
@@ -1058,6 +1501,12 @@ decrypt_buf (ntbtls_t tls)
           return err;
         }
     }
+  else if (etm)
+    {
+      err = decrypt_cbc_etm (tls);
+      if (err)
+        return err;
+    }
   else if (mode == GCRY_CIPHER_MODE_CBC)
     {
       /*
@@ -1103,22 +1552,22 @@ decrypt_buf (ntbtls_t tls)
       for (i = 0; i < tls->transform_in->ivlen; i++)
         tls->transform_in->iv_dec[i] = tls->in_iv[i];
 
-      err = gcry_cipher_reset (tls->transform_out->cipher_ctx_dec);
+      err = gcry_cipher_reset (tls->transform_in->cipher_ctx_dec);
       if (err)
         {
           debug_ret (1, "cipher_reset", err);
           return err;
         }
-      err = gcry_cipher_setiv (tls->transform_out->cipher_ctx_dec,
-                               tls->transform_out->iv_dec,
-                               tls->transform_out->ivlen);
+      err = gcry_cipher_setiv (tls->transform_in->cipher_ctx_dec,
+                               tls->transform_in->iv_dec,
+                               tls->transform_in->ivlen);
       if (err)
         {
           debug_ret (1, "cipher_setiv", err);
           return err;
         }
 
-      err = gcry_cipher_decrypt (tls->transform_out->cipher_ctx_dec,
+      err = gcry_cipher_decrypt (tls->transform_in->cipher_ctx_dec,
                                  dec_msg, dec_msglen, NULL, 0);
       if (err)
         {
@@ -1182,8 +1631,9 @@ decrypt_buf (ntbtls_t tls)
 
   /*
    * Always compute the MAC (RFC4346, CBCTIME), except for AEAD of course
+   * and for encrypt-then-MAC which has already checked the MAC.
    */
-  if (!is_aead_mode (mode))
+  if (!is_aead_mode (mode) && !etm)
     {
       unsigned char tmp[TLS_MAX_MAC_SIZE];
       size_t  extra_run;
@@ -1396,10 +1846,21 @@ ssl_decompress_buf (ntbtls_t ssl)
 }
 
 
-/* Fill the input message buffer with NB_WANT bytes.  The function
- * returns an error if the numer of requested bytes do not fit into
- * the record buffer, there is a read problem, or on EOF.  */
-gpg_error_t
+/* Note that the record buffer starting at CTR has been written up to
+ * END.  *USED is the high-water mark of the buffer.  */
+static void
+note_recbuf_used (const unsigned char *ctr, const unsigned char *end,
+                  size_t *used)
+{
+  if ((size_t)(end - ctr) > *used)
+    *used = end - ctr;
+}
+
+
+/* Fill the input message buffer with NB_WANT bytes.  The function
+ * returns an error if the numer of requested bytes do not fit into
+ * the record buffer, there is a read problem, or on EOF.  */
+gpg_error_t
 _ntbtls_fetch_input (ntbtls_t tls, size_t nb_want)
 {
   gpg_error_t err;
@@ -1410,7 +1871,7 @@ _ntbtls_fetch_input (ntbtls_t tls, size_t nb_want)
   if (!tls->inbound)
     return gpg_error (GPG_ERR_NOT_INITIALIZED);
 
-  if (nb_want > TLS_BUFFER_LEN - 8)
+  if (nb_want > tls->buffer_len - 8)
     {
       debug_msg (1, "requesting more data than fits");
       return gpg_error (GPG_ERR_REQUEST_TOO_LONG);
@@ -1434,6 +1895,8 @@ _ntbtls_fetch_input (ntbtls_t tls, size_t nb_want)
       tls->in_left += nread;
     }
 
+  note_recbuf_used (tls->in_ctr, tls->in_hdr + tls->in_left,
+                    &tls->in_buf_used);
   return err;
 }
 
@@ -1487,18 +1950,37 @@ _ntbtls_write_record (ntbtls_t tls)
 
   debug_msg (3, "write record");
 
+  /* Also account for the MAC and padding added by encrypt_buf.  */
+  note_recbuf_used (tls->out_ctr,
+                    tls->out_msg + len + TLS_MAC_ADD + TLS_PADDING_ADD,
+                    &tls->out_buf_used);
+
   if (tls->out_msgtype == TLS_MSG_HANDSHAKE)
     {
       tls->out_msg[1] = (unsigned char) ((len - 4) >> 16);
       tls->out_msg[2] = (unsigned char) ((len - 4) >> 8);
       tls->out_msg[3] = (unsigned char) ((len - 4));
 
-      if (tls->out_msg[0] != TLS_HS_HELLO_REQUEST)
+      /* Post-handshake messages (TLS 1.3) are not part of the
+       * transcript.  */
+      if (tls->out_msg[0] != TLS_HS_HELLO_REQUEST
+          && tls->state != TLS_HANDSHAKE_OVER)
         tls->handshake->update_checksum (tls, tls->out_msg, len);
     }
 
-  if (tls->transform_out
-      && tls->session_out->compression == TLS_COMPRESS_DEFLATE)
+  if (tls->ktls_tx)
+    {
+      /* The kernel protects the record.  */
+      err = _ntbtls_ktls_write_record (tls);
+      if (err)
+        {
+          debug_ret (1, "ktls_write_record", err);
+          return err;
+        }
+      done = 1;
+    }
+  else if (tls->transform_out
+           && tls->session_out->compression == TLS_COMPRESS_DEFLATE)
     {
       err = ssl_compress_buf (tls);
       if (err)
@@ -1514,7 +1996,7 @@ _ntbtls_write_record (ntbtls_t tls)
     {
       tls->out_hdr[0] = (unsigned char) tls->out_msgtype;
       tls->out_hdr[1] = (unsigned char) tls->major_ver;
-      tls->out_hdr[2] = (unsigned char) tls->minor_ver;
+      tls->out_hdr[2] = TLS_LEGACY_MINOR_VERSION (tls->minor_ver);
       tls->out_hdr[3] = (unsigned char) (len >> 8);
       tls->out_hdr[4] = (unsigned char) (len);
 
@@ -1533,6 +2015,8 @@ _ntbtls_write_record (ntbtls_t tls)
         }
 
       tls->out_left = 5 + tls->out_msglen;
+      note_recbuf_used (tls->out_ctr, tls->out_hdr + tls->out_left,
+                        &tls->out_buf_used);
 
       debug_msg (3, "output record: msgtype = %d, "
                  "version = [%d:%d], msglen = %u",
@@ -1596,6 +2080,18 @@ _ntbtls_read_record (ntbtls_t tls)
   tls->in_hslen = 0;
 
  read_record_header:
+  if (tls->ktls_rx)
+    {
+      /* The kernel has already checked and decrypted the record.  */
+      err = _ntbtls_ktls_read_record (tls);
+      if (err)
+        {
+          debug_ret (1, "ktls_read_record", err);
+          return err;
+        }
+      goto process_record;
+    }
+
   /*
    * Read the record header and validate it
    */
@@ -1627,8 +2123,39 @@ _ntbtls_read_record (ntbtls_t tls)
       return gpg_error (GPG_ERR_INV_RECORD);
     }
 
+  /*
+   * TLS 1.3 peers may send an unprotected change_cipher_spec record
+   * during the handshake for middlebox compatibility (RFC 8446, 5).
+   * It carries no information and is dropped.
+   */
+  if (tls->minor_ver == TLS_MINOR_VERSION_4
+      && tls->in_msgtype == TLS_MSG_CHANGE_CIPHER_SPEC
+      && tls->state != TLS_HANDSHAKE_OVER)
+    {
+      if (tls->in_msglen != 1)
+        {
+          debug_msg (1, "bad change_cipher_spec message");
+          return gpg_error (GPG_ERR_BAD_HS_CHANGE_CIPHER);
+        }
+      err = _ntbtls_fetch_input (tls, 6);
+      if (err)
+        {
+          debug_ret (1, "fetch_input", err);
+          return err;
+        }
+      if (tls->in_hdr[5] != 1)
+        {
+          debug_msg (1, "bad change_cipher_spec message");
+          return gpg_error (GPG_ERR_BAD_HS_CHANGE_CIPHER);
+        }
+
+      debug_msg (3, "ignoring change_cipher_spec");
+      tls->in_left = 0;
+      goto read_record_header;
+    }
+
   /* Sanity check (outer boundaries) */
-  if (tls->in_msglen < 1 || tls->in_msglen > TLS_BUFFER_LEN - 13)
+  if (tls->in_msglen < 1 || tls->in_msglen > tls->buffer_len - 13)
     {
       debug_msg (1, "bad message length");
       return gpg_error (GPG_ERR_INV_RECORD);
@@ -1718,6 +2245,11 @@ _ntbtls_read_record (ntbtls_t tls)
       tls->in_hdr[4] = (unsigned char) (tls->in_msglen);
     }
 
+ process_record:
+  /* Decompression and the kernel may write beyond the fetched bytes.  */
+  note_recbuf_used (tls->in_ctr, tls->in_msg + tls->in_msglen,
+                    &tls->in_buf_used);
+
   if (   tls->in_msgtype != TLS_MSG_HANDSHAKE
       && tls->in_msgtype != TLS_MSG_ALERT
       && tls->in_msgtype != TLS_MSG_CHANGE_CIPHER_SPEC
@@ -1921,11 +2453,41 @@ _ntbtls_write_certificate (ntbtls_t tls)
 }
 
 
+/* Compute the key for the chain cache from the certificate_list
+ * LIST of length LISTLEN and the parameters used to verify it.  The
+ * 32 byte key is stored at KEY.  */
+static void
+chain_cache_key (ntbtls_t tls, const unsigned char *list, size_t listlen,
+                 unsigned char *key)
+{
+  struct {
+    int authmode;
+    ntbtls_verify_cb_t verify_cb;
+  } params;
+  gcry_buffer_t iov[3];
+
+  /* The value for the verify callback is not part of the key because
+   * applications commonly pass per-connection data.  */
+  memset (&params, 0, sizeof params);
+  params.authmode = tls->authmode;
+  params.verify_cb = tls->verify_cb;
+
+  memset (iov, 0, sizeof iov);
+  iov[0].data = &params;
+  iov[0].len  = sizeof params;
+  iov[1].data = tls->hostname? tls->hostname : "";
+  iov[1].len  = tls->hostname? strlen (tls->hostname) + 1 : 1;
+  iov[2].data = (void *)list;
+  iov[2].len  = listlen;
+  gcry_md_hash_buffers (GCRY_MD_SHA256, 0, key, iov, 3);
+}
+
+
 gpg_error_t
 _ntbtls_read_certificate (ntbtls_t tls)
 {
   gpg_error_t err;
-  size_t i, n;
+  size_t n;
   const ciphersuite_t suite = tls->transform_negotiate->ciphersuite;
   key_exchange_type_t kex = _ntbtls_ciphersuite_get_kex (suite);
 
@@ -1998,6 +2560,22 @@ _ntbtls_read_certificate (ntbtls_t tls)
       return gpg_error (GPG_ERR_BAD_HS_CERT);
     }
 
+  return process_certificate_list (tls, tls->in_msg + 7, n);
+}
+
+
+/* Parse and verify the peer's certificate chain.  LIST are the
+ * LISTLEN bytes of certificate entries, each one a 3 byte length
+ * followed by the DER encoded certificate.  */
+static gpg_error_t
+process_certificate_list (ntbtls_t tls,
+                          const unsigned char *list, size_t listlen)
+{
+  gpg_error_t err;
+  size_t i, n;
+  unsigned char cachekey[32];
+  int cached;
+
   /* In case we tried to reuse a session but it failed. */
   if (tls->session_negotiate->peer_chain)
     {
@@ -2005,32 +2583,42 @@ _ntbtls_read_certificate (ntbtls_t tls)
       tls->session_negotiate->peer_chain = NULL;
     }
 
-  err = _ntbtls_x509_cert_new (&tls->session_negotiate->peer_chain);
-  if (err)
+  /* If we have seen and verified the same chain with the same
+   * parameters recently we can skip parsing and verifying it.  */
+  chain_cache_key (tls, list, listlen, cachekey);
+  cached = _ntbtls_x509_chain_cache_get (cachekey,
+                                         &tls->session_negotiate->peer_chain);
+  if (cached)
+    debug_msg (3, "using cached peer certificate chain");
+  else
     {
-      debug_msg (1, "allocating X.509 cert object failed");
-      return err;
+      err = _ntbtls_x509_cert_new (&tls->session_negotiate->peer_chain);
+      if (err)
+        {
+          debug_msg (1, "allocating X.509 cert object failed");
+          return err;
+        }
     }
 
-  for (i = 7; i < tls->in_hslen; )
+  for (i = 0; !cached && i < listlen; )
     {
-      if (tls->in_msg[i] != 0)
+      if (i + 3 > listlen || list[i] != 0)
         {
           debug_msg (1, "bad certificate message");
           return gpg_error (GPG_ERR_BAD_HS_CERT);
         }
 
-      n = buf16_to_size_t (tls->in_msg + i + 1);
+      n = buf16_to_size_t (list + i + 1);
       i += 3;
 
-      if (n < 128 || i + n > tls->in_hslen)
+      if (n < 128 || i + n > listlen)
         {
           debug_msg (1, "bad certificate message");
           return gpg_error (GPG_ERR_BAD_HS_CERT);
         }
 
       err = _ntbtls_x509_append_cert (tls->session_negotiate->peer_chain,
-                                      tls->in_msg + i, n);
+                                      list + i, n);
       if (err)
         {
           debug_ret (1, "x509_append_cert", err);
@@ -2065,7 +2653,7 @@ _ntbtls_read_certificate (ntbtls_t tls)
       /*   } */
     }
 
-  if (tls->authmode != TLS_VERIFY_NONE)
+  if (tls->authmode != TLS_VERIFY_NONE && !cached)
     {
       /*
        * Verify hostname
@@ -2106,7 +2694,103 @@ _ntbtls_read_certificate (ntbtls_t tls)
             err = 0;
         }
     }
+  else
+    err = 0;
+
+  if (!err && !cached)
+    _ntbtls_x509_chain_cache_put (cachekey,
+                                  tls->session_negotiate->peer_chain);
+
+  return err;
+}
+
+
+/* Read the server's TLS 1.3 Certificate message (RFC 8446, 4.4.2).
+ * The extensions of the entries are not used; they are stripped so
+ * that the certificate_list can be processed like in TLS 1.2.  */
+gpg_error_t
+_ntbtls_tls13_read_certificate (ntbtls_t tls)
+{
+  gpg_error_t err;
+  const unsigned char *p, *end;
+  unsigned char *list;
+  size_t n, left, listlen;
+
+  debug_msg (2, "read certificate");
+
+  /* The record may already have been read while looking for a
+   * CertificateRequest.  */
+  if (!tls->record_read)
+    {
+      err = _ntbtls_read_record (tls);
+      if (err)
+        {
+          debug_ret (1, "read_record", err);
+          return err;
+        }
+    }
+  tls->record_read = 0;
+
+  if (tls->in_msgtype != TLS_MSG_HANDSHAKE)
+    {
+      debug_msg (1, "bad certificate message");
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+
+  /*
+   *     0  .  0    handshake type
+   *     1  .  3    handshake length
+   *     4  .  4    length of certificate_request_context (0)
+   *     5  .  7    length of all entries
+   *     8  . ...   length of cert. 1, cert. 1,
+   *                length of extensions, extensions,
+   *                length of cert. 2, etc.
+   */
+  if (tls->in_msg[0] != TLS_HS_CERTIFICATE || tls->in_hslen < 8
+      || tls->in_msg[4] != 0
+      || tls->in_hslen != 8 + buf24_to_size_t (tls->in_msg + 5))
+    {
+      debug_msg (1, "bad certificate message");
+      return gpg_error (GPG_ERR_BAD_HS_CERT);
+    }
+
+  list = malloc (tls->in_hslen - 8);
+  if (!list)
+    return gpg_error_from_syserror ();
+
+  listlen = 0;
+  p = tls->in_msg + 8;
+  end = tls->in_msg + tls->in_hslen;
+  while (p < end)
+    {
+      left = end - p;
+      n = left < 5? 0 : buf24_to_size_t (p);
+      if (left < 5 || n > left - 5
+          || buf16_to_size_t (p + 3 + n) > left - 5 - n)
+        {
+          debug_msg (1, "bad certificate message");
+          err = gpg_error (GPG_ERR_BAD_HS_CERT);
+          goto leave;
+        }
+      memcpy (list + listlen, p, 3 + n);
+      listlen += 3 + n;
+      p += 3 + n;
+      p += 2 + buf16_to_size_t (p);
+    }
+
+  if (!listlen)
+    {
+      debug_msg (1, "server sent no certificate");
+      err = gpg_error (GPG_ERR_MISSING_CERT);
+      goto leave;
+    }
 
+  err = process_certificate_list (tls, list, listlen);
+
+ leave:
+  free (list);
+  if (!err)
+    tls->state = TLS_SERVER_CERTIFICATE_VERIFY;
   return err;
 }
 
@@ -2168,39 +2852,87 @@ _ntbtls_read_change_cipher_spec (ntbtls_t tls)
 
 
 static void
-update_checksum_sha256 (ntbtls_t tls, const unsigned char *buf, size_t len)
+update_checksum_md (ntbtls_t tls, const unsigned char *buf, size_t len)
 {
-  gcry_md_write (tls->handshake->fin_sha256, buf, len);
+  gcry_md_write (tls->handshake->fin_md, buf, len);
 }
 
 
+/* Used after the last Finished message has been computed.  */
 static void
-update_checksum_sha384 (ntbtls_t tls, const unsigned char *buf, size_t len)
+update_checksum_none (ntbtls_t tls, const unsigned char *buf, size_t len)
 {
-  gcry_md_write (tls->handshake->fin_sha512, buf, len);
+  (void)tls;
+  (void)buf;
+  (void)len;
 }
 
 
-void
-_ntbtls_optimize_checksum (ntbtls_t tls, const ciphersuite_t suite)
+/* Collect the handshake messages until the ciphersuite is known.  */
+static void
+update_checksum_start (ntbtls_t tls, const unsigned char *buf, size_t len)
 {
-  if (_ntbtls_ciphersuite_get_mac (suite) == GCRY_MAC_HMAC_SHA384)
-    tls->handshake->update_checksum = update_checksum_sha384;
-  else if (_ntbtls_ciphersuite_get_mac (suite) != GCRY_MAC_HMAC_SHA384)
-    tls->handshake->update_checksum = update_checksum_sha256;
-  else
+  handshake_params_t hs = tls->handshake;
+  unsigned char *p;
+  size_t n;
+
+  if (hs->early_msgs_err)
+    return;
+
+  if (hs->early_msgs_len + len > hs->early_msgs_size)
     {
-      debug_bug ();
-      return;
+      n = hs->early_msgs_size? hs->early_msgs_size : 1024;
+      while (n < hs->early_msgs_len + len)
+        n *= 2;
+      p = realloc (hs->early_msgs, n);
+      if (!p)
+        {
+          hs->early_msgs_err = gpg_error_from_syserror ();
+          return;
+        }
+      hs->early_msgs = p;
+      hs->early_msgs_size = n;
     }
+
+  memcpy (hs->early_msgs + hs->early_msgs_len, buf, len);
+  hs->early_msgs_len += len;
 }
 
 
-static void
-update_checksum_start (ntbtls_t tls, const unsigned char *buf, size_t len)
+/* Start the checksum over the handshake messages once the
+ * ciphersuite SUITE is known.  Only the hash algorithm required by
+ * SUITE is computed.  */
+gpg_error_t
+_ntbtls_optimize_checksum (ntbtls_t tls, const ciphersuite_t suite)
 {
-  gcry_md_write (tls->handshake->fin_sha256, buf, len);
-  gcry_md_write (tls->handshake->fin_sha512, buf, len);
+  handshake_params_t hs = tls->handshake;
+  gpg_error_t err;
+  int algo;
+
+  if (hs->early_msgs_err)
+    return hs->early_msgs_err;
+  if (hs->fin_md)
+    {
+      debug_bug ();
+      return gpg_error (GPG_ERR_INTERNAL);
+    }
+
+  if (_ntbtls_ciphersuite_get_mac (suite) == GCRY_MAC_HMAC_SHA384)
+    algo = GCRY_MD_SHA384;
+  else
+    algo = GCRY_MD_SHA256;
+
+  err = gcry_md_open (&hs->fin_md, algo, 0);
+  if (err)
+    return err;
+
+  gcry_md_write (hs->fin_md, hs->early_msgs, hs->early_msgs_len);
+  free (hs->early_msgs);
+  hs->early_msgs = NULL;
+  hs->early_msgs_len = hs->early_msgs_size = 0;
+
+  hs->update_checksum = update_checksum_md;
+  return 0;
 }
 
 
@@ -2224,15 +2956,33 @@ calc_finished_tls (ntbtls_t tls, int is_sha384,
 
   debug_msg (2, "calc finished tls sha%d", is_sha384? 384 : 256);
 
-  err = gcry_md_copy (&md, (is_sha384 ? tls->handshake->fin_sha512
-                            /*     */ : tls->handshake->fin_sha256));
-  if (err)
+  if (!tls->handshake->fin_md)
     {
-      debug_ret (1, "calc_finished_tls", err);
+      debug_bug ();
       memset (buf, 0, len);
       return;
     }
 
+  /* The client's Finished message comes last in a resumed session
+   * and the server's in a full handshake.  For the last one we can
+   * finalize the running hash instead of working on a copy.  */
+  if (!tls->handshake->resume == !is_client)
+    {
+      md = tls->handshake->fin_md;
+      tls->handshake->fin_md = NULL;
+      tls->handshake->update_checksum = update_checksum_none;
+    }
+  else
+    {
+      err = gcry_md_copy (&md, tls->handshake->fin_md);
+      if (err)
+        {
+          debug_ret (1, "calc_finished_tls", err);
+          memset (buf, 0, len);
+          return;
+        }
+    }
+
   /*
    * TLSv1.2:
    *   hash = PRF( master, finished_label,
@@ -2281,7 +3031,9 @@ _ntbtls_handshake_wrapup (ntbtls_t tls)
   debug_msg (3, "handshake wrapup");
 
   /*
-   * Free our handshake params
+   * Free our handshake params.  This releases the transcript hashes,
+   * the key exchange contexts and wipes the premaster secret.  The
+   * state required for a renegotiation is kept in the context.
    */
   handshake_params_deinit (tls->handshake);
   free (tls->handshake);
@@ -2321,6 +3073,9 @@ _ntbtls_handshake_wrapup (ntbtls_t tls)
         debug_msg (1, "cache did not store session");
     }
 
+  if ((tls->flags & NTBTLS_KTLS))
+    _ntbtls_ktls_start (tls);
+
   tls->state++;
 
   debug_msg (3, "handshake wrapup ready ");
@@ -2473,111 +3228,1069 @@ _ntbtls_read_finished (ntbtls_t tls)
 }
 
 
-static gpg_error_t
-transform_init (transform_t transform)
+/*
+ * TLS 1.3 key schedule (RFC 8446, 7.1)
+ */
+
+/* Return the hash algorithm used by the TLS 1.3 ciphersuite SUITE.  */
+static int
+tls13_md_algo (const ciphersuite_t suite)
 {
-  gpg_error_t err = 0;
+  if (_ntbtls_ciphersuite_get_mac (suite) == GCRY_MAC_HMAC_SHA384)
+    return GCRY_MD_SHA384;
+  return GCRY_MD_SHA256;
+}
 
-  (void)transform;
-  //FIXME:
-  /* cipher_init (&transform->cipher_ctx_enc); */
-  /* cipher_init (&transform->cipher_ctx_dec); */
 
-  /* md_init (&transform->mac_ctx_enc); */
-  /* md_init (&transform->mac_ctx_dec); */
+/* Store HMAC (KEY, DATA) using the hash algorithm MDALGO at OUT.
+ * This is also HKDF-Extract with KEY as salt and DATA as IKM.  */
+static gpg_error_t
+tls13_hmac (int mdalgo, const unsigned char *key, size_t keylen,
+            const unsigned char *data, size_t datalen, unsigned char *out)
+{
+  gpg_error_t err;
+  gcry_mac_hd_t hd;
+
+  err = gcry_mac_open (&hd, (mdalgo == GCRY_MD_SHA384
+                             ? GCRY_MAC_HMAC_SHA384 : GCRY_MAC_HMAC_SHA256),
+                       0, NULL);
+  if (err)
+    return err;
+  err = gcry_mac_setkey (hd, key, keylen);
+  if (!err)
+    err = sha_hmac (hd, data, datalen, out, gcry_md_get_algo_dlen (mdalgo));
+  gcry_mac_close (hd);
   return err;
 }
 
 
-static void
-transform_deinit (transform_t transform)
+/* HKDF-Expand-Label (SECRET, LABEL, CONTEXT, OUTLEN) using the hash
+ * algorithm MDALGO.  The result is stored at OUT.  TLS 1.3 never
+ * needs more than one hash block and thus OUTLEN is limited to the
+ * length of the hash.  */
+static gpg_error_t
+tls13_expand_label (int mdalgo, const unsigned char *secret,
+                    const char *label,
+                    const unsigned char *context, size_t contextlen,
+                    unsigned char *out, size_t outlen)
 {
-  if (!transform)
-    return;
-
-  //FIXME:
-  /* deflateEnd (&transform->ctx_deflate); */
-  /* inflateEnd (&transform->ctx_inflate); */
-
-  /* cipher_free (&transform->cipher_ctx_enc); */
-  /* cipher_free (&transform->cipher_ctx_dec); */
+  gpg_error_t err;
+  unsigned char info[2 + 1 + 6 + 32 + 1 + 255 + 1];
+  unsigned char tmp[48];
+  size_t hashlen = gcry_md_get_algo_dlen (mdalgo);
+  size_t labellen = strlen (label);
+  size_t n;
 
-  /* md_free (&transform->mac_ctx_enc); */
-  /* md_free (&transform->mac_ctx_dec); */
+  if (outlen > hashlen || labellen > 32 || contextlen > 255)
+    return gpg_error (GPG_ERR_INV_ARG);
 
-  wipememory (transform, sizeof *transform);
+  /*
+   * struct {
+   *     uint16 length = Length;
+   *     opaque label<7..255> = "tls13 " + Label;
+   *     opaque context<0..255> = Context;
+   * } HkdfLabel;
+   *
+   * followed by the counter octet for the first block.
+   */
+  n = 0;
+  info[n++] = (unsigned char) (outlen >> 8);
+  info[n++] = (unsigned char) (outlen);
+  info[n++] = (unsigned char) (6 + labellen);
+  memcpy (info + n, "tls13 ", 6);
+  n += 6;
+  memcpy (info + n, label, labellen);
+  n += labellen;
+  info[n++] = (unsigned char) contextlen;
+  if (contextlen)
+    memcpy (info + n, context, contextlen);
+  n += contextlen;
+  info[n++] = 1;
+
+  err = tls13_hmac (mdalgo, secret, hashlen, info, n, tmp);
+  if (!err)
+    memcpy (out, tmp, outlen);
+  wipememory (tmp, sizeof tmp);
+  return err;
 }
 
 
+/* Compute the secret of the next stage of the key schedule from
+ * SECRET and the input keying material IKM; that is
+ * HKDF-Extract (Derive-Secret (SECRET, "derived", ""), IKM).  OUT
+ * may be the same buffer as SECRET.  */
 static gpg_error_t
-session_init (session_t session)
+tls13_next_secret (int mdalgo, const unsigned char *secret,
+                   const unsigned char *ikm, size_t ikmlen,
+                   unsigned char *out)
 {
-  (void)session;
-  return 0;
+  gpg_error_t err;
+  unsigned char hash[48];
+  unsigned char derived[48];
+  size_t hashlen = gcry_md_get_algo_dlen (mdalgo);
+
+  gcry_md_hash_buffer (mdalgo, hash, "", 0);
+  err = tls13_expand_label (mdalgo, secret, "derived", hash, hashlen,
+                            derived, hashlen);
+  if (!err)
+    err = tls13_hmac (mdalgo, derived, hashlen, ikm, ikmlen, out);
+  wipememory (derived, sizeof derived);
+  return err;
 }
 
 
-static void
-session_deinit (session_t session)
+/* Store the early secret HKDF-Extract (0, PSK) at OUT.  Without a
+ * TICKET the PSK is all zeros.  */
+static gpg_error_t
+tls13_early_secret (int mdalgo, tls13_ticket_t ticket, unsigned char *out)
 {
-  if (!session)
-    return;
-
-  _ntbtls_x509_cert_release (session->peer_chain);
+  unsigned char zeros[48];
+  size_t hashlen = gcry_md_get_algo_dlen (mdalgo);
 
-  free (session->ticket);
-  wipememory (session, sizeof *session);
+  memset (zeros, 0, sizeof zeros);
+  return tls13_hmac (mdalgo, zeros, hashlen,
+                     ticket? ticket->psk : zeros, hashlen, out);
 }
 
 
-static gpg_error_t
-handshake_params_init (handshake_params_t handshake)
+/* Replace the first ClientHello in the collected handshake messages
+ * by the synthetic message_hash message (RFC 8446, 4.4.1).  This is
+ * called after the HelloRetryRequest of length HRRLEN for the
+ * ciphersuite SUITE has been added to the transcript.  */
+gpg_error_t
+_ntbtls_tls13_hrr_checksum (ntbtls_t tls, const ciphersuite_t suite,
+                            size_t hrrlen)
 {
-  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  int algo = tls13_md_algo (suite);
+  size_t hashlen = gcry_md_get_algo_dlen (algo);
+  size_t chlen;
 
-  err = gcry_md_open (&handshake->fin_sha256, GCRY_MD_SHA256, 0);
-  if (err)
-    return err;
+  if (hs->early_msgs_err)
+    return hs->early_msgs_err;
 
-  err = gcry_md_open (&handshake->fin_sha512, GCRY_MD_SHA384, 0);
-  if (err)
+  if (hs->fin_md || hs->early_msgs_len < hrrlen
+      || hs->early_msgs_len - hrrlen < 4 + hashlen)
     {
-      gcry_md_close (handshake->fin_sha256);
-      handshake->fin_sha256 = NULL;
-      return err;
+      debug_bug ();
+      return gpg_error (GPG_ERR_INTERNAL);
     }
+  chlen = hs->early_msgs_len - hrrlen;
 
-  err = _ntbtls_dhm_new (&handshake->dhm_ctx);
-  if (err)
+  gcry_md_hash_buffer (algo, hs->early_msgs + 4, hs->early_msgs, chlen);
+  hs->early_msgs[0] = TLS_HS_MESSAGE_HASH;
+  hs->early_msgs[1] = 0;
+  hs->early_msgs[2] = 0;
+  hs->early_msgs[3] = (unsigned char) hashlen;
+  memmove (hs->early_msgs + 4 + hashlen, hs->early_msgs + chlen, hrrlen);
+  hs->early_msgs_len = 4 + hashlen + hrrlen;
+
+  return 0;
+}
+
+
+/* Store the hash over the handshake messages received and sent so
+ * far at HASH which must have room for 48 bytes.  The length of the
+ * hash is stored at R_HASHLEN.  */
+gpg_error_t
+_ntbtls_tls13_transcript_hash (ntbtls_t tls, unsigned char *hash,
+                               size_t *r_hashlen)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  int algo;
+
+  if (!tls->handshake->fin_md)
     {
-      gcry_md_close (handshake->fin_sha256);
-      handshake->fin_sha256 = NULL;
-      gcry_md_close (handshake->fin_sha512);
-      handshake->fin_sha512 = NULL;
-      return err;
+      debug_bug ();
+      return gpg_error (GPG_ERR_INTERNAL);
     }
 
-  err = _ntbtls_ecdh_new (&handshake->ecdh_ctx);
+  algo = gcry_md_get_algo (tls->handshake->fin_md);
+  err = gcry_md_copy (&md, tls->handshake->fin_md);
   if (err)
-    {
-      _ntbtls_dhm_release (handshake->dhm_ctx);
-      handshake->dhm_ctx = NULL;
-      gcry_md_close (handshake->fin_sha256);
-      handshake->fin_sha256 = NULL;
-      gcry_md_close (handshake->fin_sha512);
-      handshake->fin_sha512 = NULL;
-      return err;
-    }
+    return err;
 
-  handshake->update_checksum = update_checksum_start;
-  handshake->sig_alg = TLS_HASH_SHA256;
+  *r_hashlen = gcry_md_get_algo_dlen (algo);
+  memcpy (hash, gcry_md_read (md, algo), *r_hashlen);
+  gcry_md_close (md);
 
   return 0;
 }
 
 
-static void
-handshake_params_deinit (handshake_params_t handshake)
+/* Setup the key and the IV of TRANSFORM for the outbound direction
+ * if OUTBOUND is set or else for the inbound direction from the
+ * traffic secret SECRET (RFC 8446, 7.3).  */
+static gpg_error_t
+tls13_set_traffic_key (transform_t transform,
+                       const unsigned char *secret, int outbound)
+{
+  gpg_error_t err;
+  int algo = tls13_md_algo (transform->ciphersuite);
+  size_t hashlen = gcry_md_get_algo_dlen (algo);
+  cipher_algo_t cipher;
+  cipher_mode_t mode;
+  gcry_cipher_hd_t *hdp;
+  unsigned char key[32];
+
+  cipher = _ntbtls_ciphersuite_get_cipher (transform->ciphersuite, &mode);
+  if (!cipher || !mode)
+    {
+      debug_msg (1, "cipher algo not found");
+      return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  transform->keylen = gcry_cipher_get_algo_keylen (cipher);
+  if (transform->keylen > sizeof key)
+    {
+      debug_bug ();
+      return gpg_error (GPG_ERR_BUG);
+    }
+
+  /* The entire nonce is derived from the IV and the sequence number;
+   * the minimum length is the tag and the content type.  */
+  transform->maclen = 0;
+  transform->ivlen = 12;
+  transform->fixed_ivlen = 12;
+  transform->minlen = 17;
+
+  err = tls13_expand_label (algo, secret, "key", NULL, 0,
+                            key, transform->keylen);
+  if (!err)
+    err = tls13_expand_label (algo, secret, "iv", NULL, 0,
+                              outbound? transform->iv_enc : transform->iv_dec,
+                              12);
+  if (err)
+    goto leave;
+
+  hdp = outbound? &transform->cipher_ctx_enc : &transform->cipher_ctx_dec;
+  gcry_cipher_close (*hdp);
+  *hdp = NULL;
+  err = gcry_cipher_open (hdp, cipher, mode, 0);
+  if (!err)
+    err = gcry_cipher_setkey (*hdp, key, transform->keylen);
+  if (err)
+    goto leave;
+
+  if (outbound)
+    {
+      transform->cipher_mode_enc = mode;
+      memcpy (transform->traffic_secret_enc, secret, hashlen);
+    }
+  else
+    {
+      transform->cipher_mode_dec = mode;
+      memcpy (transform->traffic_secret_dec, secret, hashlen);
+    }
+
+ leave:
+  wipememory (key, sizeof key);
+  return err;
+}
+
+
+/* Derive the handshake secret from the (EC)DHE shared secret in the
+ * premaster buffer and switch both directions to the handshake
+ * traffic keys.  This is called after the ServerHello has been added
+ * to the transcript.  If early data has been sent the outbound
+ * direction keeps the early data key until the EncryptedExtensions
+ * tell whether the server accepted it; see
+ * _ntbtls_tls13_end_early_data.  */
+gpg_error_t
+_ntbtls_tls13_derive_handshake_keys (ntbtls_t tls)
+{
+  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  transform_t transform = tls->transform_negotiate;
+  int algo = tls13_md_algo (transform->ciphersuite);
+  unsigned char hash[48];
+  size_t hashlen = gcry_md_get_algo_dlen (algo);
+
+  debug_msg (2, "derive handshake keys");
+
+  debug_buf (3, "premaster secret", hs->premaster, hs->pmslen);
+
+  err = tls13_early_secret (algo, hs->psk_accepted? hs->psk_ticket : NULL,
+                            hs->tls13_secret);
+  if (!err)
+    err = tls13_next_secret (algo, hs->tls13_secret,
+                             hs->premaster, hs->pmslen, hs->tls13_secret);
+  wipememory (hs->premaster, sizeof (hs->premaster));
+
+  if (!err)
+    err = _ntbtls_tls13_transcript_hash (tls, hash, &hashlen);
+  if (!err)
+    err = tls13_expand_label (algo, hs->tls13_secret, "c hs traffic",
+                              hash, hashlen, hs->tls13_cli_hs_secret, hashlen);
+  if (!err)
+    err = tls13_expand_label (algo, hs->tls13_secret, "s hs traffic",
+                              hash, hashlen, hs->tls13_srv_hs_secret, hashlen);
+  if (!err && !hs->early_data_sent)
+    err = tls13_set_traffic_key (transform, (tls->is_client
+                                             ? hs->tls13_cli_hs_secret
+                                             : hs->tls13_srv_hs_secret), 1);
+  if (!err)
+    err = tls13_set_traffic_key (transform, (tls->is_client
+                                             ? hs->tls13_srv_hs_secret
+                                             : hs->tls13_cli_hs_secret), 0);
+  if (err)
+    {
+      debug_ret (1, "derive_handshake_keys", err);
+      return err;
+    }
+
+  debug_msg (3, "ciphersuite = %s",
+             _ntbtls_ciphersuite_get_name (tls->session_negotiate->ciphersuite));
+  debug_buf (4, "handshake secret", hs->tls13_secret, hashlen);
+
+  /*
+   * All further handshake messages are protected.
+   */
+  debug_msg (3, "switching to handshake traffic keys");
+  tls->transform_in = transform;
+  tls->transform_out = transform;
+  tls->session_in = tls->session_negotiate;
+  tls->session_out = tls->session_negotiate;
+  memset (tls->in_ctr, 0, 8);
+  if (!hs->early_data_sent)
+    memset (tls->out_ctr, 0, 8);
+  tls->in_msg = tls->in_iv;
+  tls->out_msg = tls->out_iv;
+
+  return 0;
+}
+
+
+/* Switch the outbound direction from the early data key to the
+ * client's handshake traffic key.  This is called after the
+ * EndOfEarlyData has been sent or, if the server rejected the early
+ * data, right after the EncryptedExtensions.  */
+gpg_error_t
+_ntbtls_tls13_end_early_data (ntbtls_t tls)
+{
+  gpg_error_t err;
+
+  debug_msg (3, "switching to handshake traffic keys for outbound data");
+  err = tls13_set_traffic_key (tls->transform_negotiate,
+                               tls->handshake->tls13_cli_hs_secret, 1);
+  if (err)
+    {
+      debug_ret (1, "set_traffic_key", err);
+      return err;
+    }
+  memset (tls->out_ctr, 0, 8);
+
+  return 0;
+}
+
+
+/* Derive the master secret and the application traffic secrets.
+ * This is called after the server's Finished has been added to the
+ * transcript.  The inbound direction is switched to the server's
+ * application traffic key; the client's secret is kept until the
+ * client's Finished has been sent.  */
+static gpg_error_t
+tls13_derive_app_keys (ntbtls_t tls)
+{
+  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  int algo = tls13_md_algo (tls->transform_negotiate->ciphersuite);
+  unsigned char zeros[48];
+  unsigned char hash[48];
+  unsigned char secret[48];
+  size_t hashlen = gcry_md_get_algo_dlen (algo);
+
+  memset (zeros, 0, sizeof zeros);
+  err = tls13_next_secret (algo, hs->tls13_secret, zeros, hashlen,
+                           hs->tls13_secret);
+  if (!err)
+    err = _ntbtls_tls13_transcript_hash (tls, hash, &hashlen);
+  if (!err)
+    err = tls13_expand_label (algo, hs->tls13_secret, "c ap traffic",
+                              hash, hashlen, hs->tls13_cli_ap_secret, hashlen);
+  if (!err)
+    err = tls13_expand_label (algo, hs->tls13_secret, "s ap traffic",
+                              hash, hashlen, secret, hashlen);
+  if (!err)
+    err = tls13_set_traffic_key (tls->transform_negotiate, secret, 0);
+  wipememory (secret, sizeof secret);
+  if (err)
+    {
+      debug_ret (1, "derive_app_keys", err);
+      return err;
+    }
+
+  debug_msg (3, "switching to application traffic keys for inbound data");
+  memset (tls->in_ctr, 0, 8);
+
+  return 0;
+}
+
+
+/* Compute the verify_data of the client's Finished message if
+ * IS_CLIENT is set or else of the server's Finished message over the
+ * current transcript (RFC 8446, 4.4.4).  BUF must have room for 48
+ * bytes; the length is stored at R_LEN.  */
+static gpg_error_t
+tls13_calc_finished (ntbtls_t tls, unsigned char *buf, size_t *r_len,
+                     int is_client)
+{
+  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  int algo = tls13_md_algo (tls->transform_negotiate->ciphersuite);
+  unsigned char key[48];
+  unsigned char hash[48];
+  size_t hashlen = gcry_md_get_algo_dlen (algo);
+
+  err = tls13_expand_label (algo, (is_client
+                                   ? hs->tls13_cli_hs_secret
+                                   : hs->tls13_srv_hs_secret),
+                            "finished", NULL, 0, key, hashlen);
+  if (!err)
+    err = _ntbtls_tls13_transcript_hash (tls, hash, &hashlen);
+  if (!err)
+    err = tls13_hmac (algo, key, hashlen, hash, hashlen, buf);
+  wipememory (key, sizeof key);
+  if (err)
+    return err;
+
+  *r_len = hashlen;
+  debug_buf (3, "calc finished result", buf, hashlen);
+  return 0;
+}
+
+
+/* Derive the resumption master secret and store it in the
+ * session.  */
+static gpg_error_t
+tls13_resumption_secret (ntbtls_t tls)
+{
+  gpg_error_t err;
+  int algo = tls13_md_algo (tls->transform_negotiate->ciphersuite);
+  unsigned char hash[48];
+  size_t hashlen;
+
+  err = _ntbtls_tls13_transcript_hash (tls, hash, &hashlen);
+  if (!err)
+    err = tls13_expand_label (algo, tls->handshake->tls13_secret,
+                              "res master", hash, hashlen,
+                              tls->session_negotiate->master, hashlen);
+  return err;
+}
+
+
+/* Write the client's TLS 1.3 Finished message and switch the
+ * outbound direction to the application traffic key.  */
+gpg_error_t
+_ntbtls_tls13_write_finished (ntbtls_t tls)
+{
+  gpg_error_t err;
+  size_t hashlen;
+
+  debug_msg (2, "write finished");
+
+  err = tls13_calc_finished (tls, tls->out_msg + 4, &hashlen, tls->is_client);
+  if (err)
+    {
+      debug_ret (1, "calc_finished", err);
+      return err;
+    }
+
+  tls->out_msglen = 4 + hashlen;
+  tls->out_msgtype = TLS_MSG_HANDSHAKE;
+  tls->out_msg[0] = TLS_HS_FINISHED;
+
+  err = _ntbtls_write_record (tls);
+  if (err)
+    {
+      debug_ret (1, "write_record", err);
+      return err;
+    }
+
+  /* The resumption master secret covers the transcript up to our
+   * Finished.  It is kept in the session to derive the PSKs of the
+   * tickets the server sends later.  */
+  err = tls13_resumption_secret (tls);
+  if (err)
+    {
+      debug_ret (1, "resumption_secret", err);
+      return err;
+    }
+
+  debug_msg (3, "switching to application traffic keys for outbound data");
+  err = tls13_set_traffic_key (tls->transform_negotiate,
+                               tls->handshake->tls13_cli_ap_secret, 1);
+  if (err)
+    {
+      debug_ret (1, "set_traffic_key", err);
+      return err;
+    }
+  memset (tls->out_ctr, 0, 8);
+
+  tls->state = TLS_FLUSH_BUFFERS;
+
+  return 0;
+}
+
+
+/* Read and check the server's TLS 1.3 Finished message and switch the
+ * inbound direction to the application traffic key.  */
+gpg_error_t
+_ntbtls_tls13_read_finished (ntbtls_t tls)
+{
+  gpg_error_t err;
+  unsigned char buf[48];
+  size_t hashlen;
+
+  debug_msg (2, "read finished");
+
+  /* The verify_data covers the transcript up to the message before
+   * the Finished; thus we need to compute it before reading.  */
+  err = tls13_calc_finished (tls, buf, &hashlen, !tls->is_client);
+  if (err)
+    {
+      debug_ret (1, "calc_finished", err);
+      return err;
+    }
+
+  err = _ntbtls_read_record (tls);
+  if (err)
+    {
+      debug_ret (1, "read_record", err);
+      return err;
+    }
+
+  if (tls->in_msgtype != TLS_MSG_HANDSHAKE)
+    {
+      debug_msg (1, "bad finished message");
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+
+  if (tls->in_msg[0] != TLS_HS_FINISHED || tls->in_hslen != 4 + hashlen)
+    {
+      debug_msg (1, "bad finished message");
+      return gpg_error (GPG_ERR_BAD_HS_FINISHED);
+    }
+
+  if (memcmpct (tls->in_msg + 4, buf, hashlen))
+    {
+      debug_msg (1, "bad finished message");
+      debug_buf (2, "want", buf, hashlen);
+      debug_buf (2, " got", tls->in_msg+4, hashlen);
+      return gpg_error (GPG_ERR_BAD_HS_FINISHED);
+    }
+
+  err = tls13_derive_app_keys (tls);
+  if (err)
+    return err;
+
+  if (tls->handshake->early_data_accepted)
+    tls->state = TLS_END_OF_EARLY_DATA;
+  else if (tls->client_auth)
+    tls->state = TLS_CLIENT_CERTIFICATE;
+  else
+    tls->state = TLS_CLIENT_FINISHED;
+
+  return 0;
+}
+
+
+/* Switch the traffic key of the current transform for the outbound
+ * direction if OUTBOUND is set or else for the inbound direction to
+ * the next generation (RFC 8446, 7.2).  */
+static gpg_error_t
+tls13_update_traffic_key (ntbtls_t tls, int outbound)
+{
+  gpg_error_t err;
+  transform_t transform = tls->transform;
+  int algo = tls13_md_algo (transform->ciphersuite);
+  unsigned char secret[48];
+
+  err = tls13_expand_label (algo, (outbound
+                                   ? transform->traffic_secret_enc
+                                   : transform->traffic_secret_dec),
+                            "traffic upd", NULL, 0,
+                            secret, gcry_md_get_algo_dlen (algo));
+  if (!err)
+    err = tls13_set_traffic_key (transform, secret, outbound);
+  wipememory (secret, sizeof secret);
+  if (err)
+    return err;
+
+  memset (outbound? tls->out_ctr : tls->in_ctr, 0, 8);
+
+  /* The kernel needs to switch its key as well.  With TLS 1.3 it
+   * only handles our records; see ktls.c.  */
+  if (outbound && tls->ktls_tx)
+    return _ntbtls_ktls_set_key (tls, 1);
+
+  return 0;
+}
+
+
+/* Store the record protection key of the current transform for the
+ * outbound direction if OUTBOUND is set or else for the inbound
+ * direction at KEY, which must have room for 32 bytes.  This is used
+ * to hand the key over to the kernel.  */
+gpg_error_t
+_ntbtls_get_traffic_key (ntbtls_t tls, int outbound, unsigned char *key)
+{
+  transform_t transform = tls->transform;
+
+  if (transform->keylen > sizeof transform->ktls_key_enc)
+    {
+      debug_bug ();
+      return gpg_error (GPG_ERR_BUG);
+    }
+
+  if (tls->minor_ver == TLS_MINOR_VERSION_4)
+    return tls13_expand_label (tls13_md_algo (transform->ciphersuite),
+                               (outbound
+                                ? transform->traffic_secret_enc
+                                : transform->traffic_secret_dec),
+                               "key", NULL, 0, key, transform->keylen);
+
+  memcpy (key, (outbound? transform->ktls_key_enc : transform->ktls_key_dec),
+          transform->keylen);
+  return 0;
+}
+
+
+/* Compute the key for the ticket cache from the hostname and the
+ * other parameters of TLS which must match for a resumption.  The
+ * 32 byte key is stored at KEY.  */
+static void
+ticket_cache_key (ntbtls_t tls, unsigned char *key)
+{
+  struct {
+    int authmode;
+    ntbtls_verify_cb_t verify_cb;
+  } params;
+  gcry_md_hd_t md;
+  const char **p;
+
+  memset (&params, 0, sizeof params);
+  params.authmode = tls->authmode;
+  params.verify_cb = tls->verify_cb;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA256, 0))
+    {
+      /* Use a key which will never match.  */
+      gcry_create_nonce (key, 32);
+      return;
+    }
+  gcry_md_write (md, &params, sizeof params);
+  if (tls->hostname)
+    gcry_md_write (md, tls->hostname, strlen (tls->hostname));
+  gcry_md_write (md, "", 1);
+  for (p = tls->alpn_list; p && *p; p++)
+    gcry_md_write (md, *p, strlen (*p) + 1);
+  memcpy (key, gcry_md_read (md, 0), 32);
+  gcry_md_close (md);
+}
+
+
+/* Take a ticket for resuming a session with the server of TLS from
+ * the ticket cache.  Returns NULL if there is none.  */
+tls13_ticket_t
+_ntbtls_tls13_take_ticket (ntbtls_t tls)
+{
+  tls13_ticket_t ticket;
+  unsigned char key[32];
+
+  ticket_cache_key (tls, key);
+  ticket = _ntbtls_ticket_cache_take (key);
+  if (ticket
+      && !_ntbtls_ciphersuite_version_ok (_ntbtls_ciphersuite_from_id
+                                          (ticket->ciphersuite),
+                                          TLS_MINOR_VERSION_4,
+                                          TLS_MINOR_VERSION_4))
+    {
+      _ntbtls_ticket_release (ticket);
+      ticket = NULL;
+    }
+  if (ticket)
+    debug_msg (3, "using session ticket for resumption");
+
+  return ticket;
+}
+
+
+/* Compute the PSK binder for the ticket to be offered over the
+ * partial ClientHello MSG of length MSGLEN (RFC 8446, 4.2.11.2).
+ * BINDER must have room for 48 bytes.  */
+gpg_error_t
+_ntbtls_tls13_psk_binder (ntbtls_t tls,
+                          const unsigned char *msg, size_t msglen,
+                          unsigned char *binder)
+{
+  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  int algo = tls13_md_algo (_ntbtls_ciphersuite_from_id
+                            (hs->psk_ticket->ciphersuite));
+  unsigned char secret[48];
+  unsigned char key[48];
+  unsigned char hash[48];
+  size_t hashlen = gcry_md_get_algo_dlen (algo);
+  gcry_buffer_t iov[2];
+
+  if (hs->early_msgs_err)
+    return hs->early_msgs_err;
+  if (hs->fin_md)
+    {
+      debug_bug ();
+      return gpg_error (GPG_ERR_INTERNAL);
+    }
+
+  gcry_md_hash_buffer (algo, hash, "", 0);
+  err = tls13_early_secret (algo, hs->psk_ticket, secret);
+  if (!err)
+    err = tls13_expand_label (algo, secret, "res binder", hash, hashlen,
+                              secret, hashlen);
+  if (!err)
+    err = tls13_expand_label (algo, secret, "finished", NULL, 0,
+                              key, hashlen);
+  if (err)
+    goto leave;
+
+  /* The transcript is that of a HelloRetryRequest, if any, and the
+   * ClientHello up to the binders.  */
+  memset (iov, 0, sizeof iov);
+  iov[0].data = hs->early_msgs;
+  iov[0].len  = hs->early_msgs_len;
+  iov[1].data = (void *)msg;
+  iov[1].len  = msglen;
+  err = gcry_md_hash_buffers (algo, 0, hash, iov, 2);
+  if (!err)
+    err = tls13_hmac (algo, key, hashlen, hash, hashlen, binder);
+
+ leave:
+  wipememory (secret, sizeof secret);
+  wipememory (key, sizeof key);
+  return err;
+}
+
+
+/* Send the early data set with ntbtls_set_early_data under the key
+ * derived from the offered ticket.  This is called right after the
+ * ClientHello has been written.  */
+gpg_error_t
+_ntbtls_tls13_write_early_data (ntbtls_t tls)
+{
+  gpg_error_t err;
+  handshake_params_t hs = tls->handshake;
+  transform_t transform = tls->transform_negotiate;
+  int algo;
+  unsigned char secret[48];
+  unsigned char hash[48];
+  size_t hashlen, n, off;
+  unsigned int max_len = mfl_code_to_length[tls->mfl_code];
+
+  debug_msg (2, "write early data");
+
+  transform->ciphersuite
+    = _ntbtls_ciphersuite_from_id (hs->psk_ticket->ciphersuite);
+  algo = tls13_md_algo (transform->ciphersuite);
+  hashlen = gcry_md_get_algo_dlen (algo);
+
+  if (hs->early_msgs_err)
+    return hs->early_msgs_err;
+  gcry_md_hash_buffer (algo, hash, hs->early_msgs, hs->early_msgs_len);
+
+  err = tls13_early_secret (algo, hs->psk_ticket, secret);
+  if (!err)
+    err = tls13_expand_label (algo, secret, "c e traffic", hash, hashlen,
+                              secret, hashlen);
+  if (!err)
+    err = tls13_set_traffic_key (transform, secret, 1);
+  wipememory (secret, sizeof secret);
+  if (err)
+    {
+      debug_ret (1, "set_traffic_key", err);
+      return err;
+    }
+
+  /* The records are now protected as defined by TLS 1.3.  */
+  tls->minor_ver = TLS_MINOR_VERSION_4;
+  tls->transform_out = transform;
+  tls->session_out = tls->session_negotiate;
+  memset (tls->out_ctr, 0, 8);
+
+  for (off = 0; off < tls->early_data_len; off += n)
+    {
+      n = tls->early_data_len - off;
+      if (n > max_len)
+        n = max_len;
+
+      tls->out_msgtype = TLS_MSG_APPLICATION_DATA;
+      tls->out_msglen = n;
+      memcpy (tls->out_msg, tls->early_data + off, n);
+
+      err = _ntbtls_write_record (tls);
+      if (err)
+        {
+          debug_ret (1, "write_record", err);
+          return err;
+        }
+    }
+
+  hs->early_data_sent = 1;
+
+  return 0;
+}
+
+
+/* Process a TLS 1.3 NewSessionTicket and put the ticket into the
+ * ticket cache.  */
+static gpg_error_t
+tls13_parse_new_session_ticket (ntbtls_t tls)
+{
+  const unsigned char *msg = tls->in_msg;
+  size_t len = tls->in_hslen;
+  const unsigned char *nonce, *data, *ext;
+  size_t noncelen, datalen, extlen, n;
+  uint32_t lifetime;
+  uint32_t max_early_data = 0;
+  tls13_ticket_t ticket;
+  unsigned char key[32];
+  gpg_error_t err;
+  int algo;
+
+  debug_msg (2, "read new_session_ticket");
+
+  /*
+   *     0  .   0   handshake message type
+   *     1  .   3   handshake message length
+   *     4  .   7   ticket_lifetime
+   *     8  .  11   ticket_age_add
+   *    12  .  12   length of ticket_nonce
+   *    13  . ...   ticket_nonce,
+   *                length of ticket (2), ticket,
+   *                length of extensions (2), extensions
+   */
+  if (len < 13)
+    goto bad;
+  noncelen = msg[12];
+  nonce = msg + 13;
+  n = 13 + noncelen;
+  if (len < n + 2)
+    goto bad;
+  datalen = buf16_to_size_t (msg + n);
+  n += 2;
+  data = msg + n;
+  n += datalen;
+  if (!datalen || len < n + 2)
+    goto bad;
+  extlen = buf16_to_size_t (msg + n);
+  n += 2;
+  ext = msg + n;
+  if (len != n + extlen)
+    goto bad;
+
+  while (extlen)
+    {
+      size_t ext_size;
+
+      if (extlen < 4 || (ext_size = buf16_to_size_t (ext + 2)) + 4 > extlen)
+        goto bad;
+      if (buf16_to_uint (ext) == TLS_EXT_EARLY_DATA)
+        {
+          if (ext_size != 4)
+            goto bad;
+          max_early_data = buf32_to_u32 (ext + 4);
+        }
+      extlen -= 4 + ext_size;
+      ext += 4 + ext_size;
+    }
+
+  /* RFC 8446 4.6.1: The lifetime must not exceed 7 days.  */
+  lifetime = buf32_to_u32 (msg + 4);
+  if (!lifetime || lifetime > 604800)
+    {
+      debug_msg (2, "ignoring new_session_ticket with lifetime %lu",
+                 (unsigned long)lifetime);
+      return 0;
+    }
+
+  ticket = calloc (1, sizeof *ticket + datalen);
+  if (!ticket)
+    return gpg_error_from_syserror ();
+
+  algo = tls13_md_algo (tls->transform->ciphersuite);
+  err = tls13_expand_label (algo, tls->session->master, "resumption",
+                            nonce, noncelen,
+                            ticket->psk, gcry_md_get_algo_dlen (algo));
+  if (err)
+    {
+      _ntbtls_ticket_release (ticket);
+      return err;
+    }
+  ticket->ciphersuite = tls->session->ciphersuite;
+  ticket->received = time (NULL);
+  ticket->lifetime = lifetime;
+  ticket->age_add = buf32_to_u32 (msg + 8);
+  ticket->max_early_data = max_early_data;
+  ticket->peer_chain = tls->session->peer_chain;
+  _ntbtls_x509_cert_ref (ticket->peer_chain);
+  ticket->ticket_len = datalen;
+  memcpy (ticket->ticket, data, datalen);
+
+  debug_msg (3, "ticket lifetime: %lu, max. early data: %lu",
+             (unsigned long)lifetime, (unsigned long)max_early_data);
+
+  ticket_cache_key (tls, key);
+  _ntbtls_ticket_cache_put (key, ticket);
+
+  return 0;
+
+ bad:
+  debug_msg (1, "bad new_session_ticket message");
+  return gpg_error (GPG_ERR_BAD_TICKET);
+}
+
+
+/* Process the TLS 1.3 post-handshake message in the input buffer.  */
+static gpg_error_t
+tls13_post_handshake_msg (ntbtls_t tls)
+{
+  gpg_error_t err;
+
+  switch (tls->in_msg[0])
+    {
+    case TLS_HS_NEW_SESSION_TICKET:
+      return tls13_parse_new_session_ticket (tls);
+
+    case TLS_HS_KEY_UPDATE:
+      if (tls->in_hslen != 5 || tls->in_msg[4] > 1)
+        {
+          debug_msg (1, "bad key_update message");
+          return gpg_error (GPG_ERR_INV_RECORD);
+        }
+      debug_msg (2, "got key_update (update %srequested)",
+                 tls->in_msg[4]? "" : "not ");
+
+      err = tls13_update_traffic_key (tls, 0);
+      if (err)
+        {
+          debug_ret (1, "update_traffic_key", err);
+          return err;
+        }
+
+      if (tls->in_msg[4])
+        {
+          /* Tell the peer that we switch our key too.  */
+          tls->out_msgtype = TLS_MSG_HANDSHAKE;
+          tls->out_msglen = 5;
+          tls->out_msg[0] = TLS_HS_KEY_UPDATE;
+          tls->out_msg[4] = 0;
+
+          err = _ntbtls_write_record (tls);
+          if (err)
+            {
+              debug_ret (1, "write_record", err);
+              return err;
+            }
+
+          err = tls13_update_traffic_key (tls, 1);
+          if (err)
+            {
+              debug_ret (1, "update_traffic_key", err);
+              return err;
+            }
+        }
+      return 0;
+
+    default:
+      debug_msg (1, "unexpected post-handshake message %d", tls->in_msg[0]);
+      return gpg_error (GPG_ERR_UNEXPECTED_MSG);
+    }
+}
+
+
+static gpg_error_t
+transform_init (transform_t transform)
+{
+  gpg_error_t err = 0;
+
+  (void)transform;
+  //FIXME:
+  /* cipher_init (&transform->cipher_ctx_enc); */
+  /* cipher_init (&transform->cipher_ctx_dec); */
+
+  /* md_init (&transform->mac_ctx_enc); */
+  /* md_init (&transform->mac_ctx_dec); */
+  return err;
+}
+
+
+static void
+transform_deinit (transform_t transform)
+{
+  if (!transform)
+    return;
+
+  //FIXME:
+  /* deflateEnd (&transform->ctx_deflate); */
+  /* inflateEnd (&transform->ctx_inflate); */
+
+  gcry_cipher_close (transform->cipher_ctx_enc);
+  gcry_cipher_close (transform->cipher_ctx_dec);
+
+  gcry_mac_close (transform->mac_ctx_enc);
+  gcry_mac_close (transform->mac_ctx_dec);
+
+  wipememory (transform, sizeof *transform);
+}
+
+
+static gpg_error_t
+session_init (session_t session)
+{
+  (void)session;
+  return 0;
+}
+
+
+static void
+session_deinit (session_t session)
+{
+  if (!session)
+    return;
+
+  _ntbtls_x509_cert_release (session->peer_chain);
+
+  free (session->ticket);
+  wipememory (session, sizeof *session);
+}
+
+
+static gpg_error_t
+handshake_params_init (handshake_params_t handshake)
+{
+  gpg_error_t err;
+
+  err = _ntbtls_dhm_new (&handshake->dhm_ctx);
+  if (err)
+    return err;
+
+  err = _ntbtls_ecdh_new (&handshake->ecdh_ctx);
+  if (err)
+    {
+      _ntbtls_dhm_release (handshake->dhm_ctx);
+      handshake->dhm_ctx = NULL;
+      return err;
+    }
+
+  handshake->update_checksum = update_checksum_start;
+  handshake->sig_alg = TLS_HASH_SHA256;
+
+  return 0;
+}
+
+
+static void
+handshake_params_deinit (handshake_params_t handshake)
 {
   if (!handshake)
     return;
@@ -2587,7 +4300,16 @@ handshake_params_deinit (handshake_params_t handshake)
   _ntbtls_ecdh_release (handshake->ecdh_ctx);
   handshake->ecdh_ctx = NULL;
 
+  gcry_md_close (handshake->fin_md);
+  handshake->fin_md = NULL;
+  free (handshake->early_msgs);
+  handshake->early_msgs = NULL;
+
   free (handshake->curves);
+  free (handshake->cookie);
+
+  _ntbtls_ticket_release (handshake->psk_ticket);
+  handshake->psk_ticket = NULL;
 
   /* Free only the linked list wrapper, not the keys themselves since
      the belong to the SNI callback. */
@@ -2684,11 +4406,392 @@ handshake_init (ntbtls_t tls)
 }
 
 
+/* Put the wiped record buffer RB into the pool shared by all
+ * threads or free it if the pool is full.  */
+static void
+recbuf_pool_put (struct recbuf_s *rb)
+{
+  gpgrt_lock_lock (&recbuf_pool_lock);
+  if (recbuf_pool_count < RECBUF_POOL_MAX)
+    {
+      rb->next = recbuf_pool;
+      recbuf_pool = rb;
+      recbuf_pool_count++;
+      rb = NULL;
+    }
+  gpgrt_lock_unlock (&recbuf_pool_lock);
+
+  free (rb);
+}
+
+
+#ifdef USE_RECBUF_CACHE
+/* Destructor for the cache of a terminating thread.  */
+static void
+recbuf_cache_release (void *value)
+{
+  struct recbuf_s *rb, *next;
+
+  for (rb = value; rb; rb = next)
+    {
+      next = rb->next;
+      recbuf_pool_put (rb);
+    }
+}
+
+
+static void
+recbuf_cache_init (void)
+{
+  recbuf_cache_ok = !pthread_key_create (&recbuf_cache_key,
+                                         recbuf_cache_release);
+}
+
+
+/* Take a buffer from the cache of the current thread.  Returns NULL
+ * if the cache is empty.  */
+static struct recbuf_s *
+recbuf_cache_get (void)
+{
+  struct recbuf_s *rb;
+
+  if (pthread_once (&recbuf_cache_once, recbuf_cache_init)
+      || !recbuf_cache_ok)
+    return NULL;
+
+  rb = pthread_getspecific (recbuf_cache_key);
+  if (rb)
+    {
+      if (pthread_setspecific (recbuf_cache_key, rb->next))
+        return NULL;
+      if (rb->next)
+        rb->next->count = rb->count - 1;
+    }
+  return rb;
+}
+
+
+/* Put the wiped buffer RB into the cache of the current thread.
+ * Returns false if the cache is full.  */
+static int
+recbuf_cache_put (struct recbuf_s *rb)
+{
+  struct recbuf_s *head;
+
+  if (pthread_once (&recbuf_cache_once, recbuf_cache_init)
+      || !recbuf_cache_ok)
+    return 0;
+
+  head = pthread_getspecific (recbuf_cache_key);
+  if (head && head->count >= RECBUF_CACHE_MAX)
+    return 0;
+
+  rb->next = head;
+  rb->count = head? head->count + 1 : 1;
+  return !pthread_setspecific (recbuf_cache_key, rb);
+}
+#endif /*USE_RECBUF_CACHE*/
+
+
+/* Return a zeroed record buffer of LEN bytes.  Buffers of
+ * TLS_BUFFER_LEN bytes are taken from the cache of the current
+ * thread or from the pool if possible.  Returns NULL and sets ERRNO
+ * on error.  */
+static unsigned char *
+recbuf_alloc (size_t len)
+{
+  struct recbuf_s *rb = NULL;
+
+  if (len != TLS_BUFFER_LEN)
+    return calloc (1, len);
+
+#ifdef USE_RECBUF_CACHE
+  rb = recbuf_cache_get ();
+#endif
+  if (!rb)
+    {
+      gpgrt_lock_lock (&recbuf_pool_lock);
+      rb = recbuf_pool;
+      if (rb)
+        {
+          recbuf_pool = rb->next;
+          recbuf_pool_count--;
+        }
+      gpgrt_lock_unlock (&recbuf_pool_lock);
+    }
+
+  if (!rb)
+    return calloc (1, TLS_BUFFER_LEN);
+
+  /* The remaining bytes have been wiped by recbuf_free.  */
+  memset (rb, 0, sizeof *rb);
+  return (unsigned char *)rb;
+}
+
+
+/* Wipe the first USED bytes of the record buffer BUF of LEN bytes and
+ * return it to the cache of the current thread or to the pool.  USED
+ * must cover every byte ever written to the buffer so that the rest
+ * is still zero; see note_recbuf_used and handshake_loop.  If the
+ * pool is full or the buffer has not the standard size the buffer is
+ * freed.  */
+static void
+recbuf_free (unsigned char *buf, size_t len, size_t used)
+{
+  struct recbuf_s *rb;
+
+  if (!buf)
+    return;
+
+  wipememory (buf, used < len? used : len);
+  if (len != TLS_BUFFER_LEN)
+    {
+      free (buf);
+      return;
+    }
+
+  rb = (struct recbuf_s *)buf;
+#ifdef USE_RECBUF_CACHE
+  if (recbuf_cache_put (rb))
+    return;
+#endif
+  recbuf_pool_put (rb);
+}
+
+
+/* Return true if no partial record, unread application data or
+ * unprocessed handshake message is held in the record buffers.  */
+static int
+record_buffers_idle (ntbtls_t tls)
+{
+  return !(tls->in_left || tls->in_offt || tls->out_left
+           || (tls->in_hslen && tls->in_hslen < tls->in_msglen));
+}
+
+
+/* Make sure that the record buffers of TLS are allocated.  If they
+ * had been released by release_idle_record_buffers the saved
+ * sequence counters and message offsets are restored along with the
+ * bytes read by wait_for_record.  */
+static gpg_error_t
+acquire_record_buffers (ntbtls_t tls)
+{
+  gpg_error_t err;
+
+  if (tls->in_ctr)
+    return 0;  /* Already allocated.  */
+
+  tls->in_ctr = recbuf_alloc (tls->buffer_len);
+  if (!tls->in_ctr)
+    return gpg_error_from_syserror ();
+
+  tls->out_ctr = recbuf_alloc (tls->buffer_len);
+  if (!tls->out_ctr)
+    {
+      err = gpg_error_from_syserror ();
+      recbuf_free (tls->in_ctr, tls->buffer_len, 0);
+      tls->in_ctr = NULL;
+      return err;
+    }
+  tls->in_buf_used = tls->out_buf_used = 8;
+
+  memcpy (tls->in_ctr, tls->saved_in_ctr, 8);
+  tls->in_hdr = tls->in_ctr + 8;
+  tls->in_iv  = tls->in_ctr + 13;
+  tls->in_msg = tls->in_ctr + tls->saved_in_msg_off;
+
+  memcpy (tls->out_ctr, tls->saved_out_ctr, 8);
+  tls->out_hdr = tls->out_ctr + 8;
+  tls->out_iv  = tls->out_ctr + 13;
+  tls->out_msg = tls->out_ctr + tls->saved_out_msg_off;
+
+  if (tls->lazy_hdr_len)
+    {
+      memcpy (tls->in_hdr, tls->lazy_hdr, tls->lazy_hdr_len);
+      tls->in_left = tls->lazy_hdr_len;
+      tls->lazy_hdr_len = 0;
+      note_recbuf_used (tls->in_ctr, tls->in_hdr + tls->in_left,
+                        &tls->in_buf_used);
+    }
+
+  return 0;
+}
+
+
+/* Read the header of the next record into the small LAZY_HDR buffer.
+ * This is used while the record buffers are released so that a
+ * reader blocked on an idle connection does not hold them.  */
+static gpg_error_t
+wait_for_record (ntbtls_t tls)
+{
+  gpg_error_t err = 0;
+  size_t nread;
+
+  if (!tls->inbound)
+    return gpg_error (GPG_ERR_NOT_INITIALIZED);
+
+  while (tls->lazy_hdr_len < sizeof tls->lazy_hdr)
+    {
+      if (es_read (tls->inbound, tls->lazy_hdr + tls->lazy_hdr_len,
+                   sizeof tls->lazy_hdr - tls->lazy_hdr_len, &nread))
+        err = gpg_error_from_syserror ();
+      else if (!nread) /*ie. EOF*/
+        err = gpg_error (GPG_ERR_EOF);
+
+      debug_ret (3, "es_read", err);
+
+      if (err)
+        break;
+
+      tls->lazy_hdr_len += nread;
+    }
+
+  return err;
+}
+
+
+/* Change the size of the record buffers of TLS to LEN bytes; the
+ * sequence counters, message offsets including the read position of
+ * pending application data, and the pending data are carried over.  Shrinking buffers which still hold data is deferred until
+ * release_idle_record_buffers finds them idle.  If allocating the new
+ * buffers fails an error is returned and the resize is also tried
+ * again later.  */
+static gpg_error_t
+resize_record_buffers (ntbtls_t tls, size_t len)
+{
+  gpg_error_t err;
+  unsigned char *in_ctr, *out_ctr;
+  size_t in_used, out_used;
+
+  tls->wanted_buffer_len = 0;
+  if (len == tls->buffer_len)
+    return 0;
+
+  if (!tls->in_ctr)
+    {
+      /* Lazy mode: Use the new size on the next allocation.  */
+      tls->buffer_len = len;
+      return 0;
+    }
+
+  if (record_buffers_idle (tls))
+    in_used = out_used = 8;
+  else if (len > tls->buffer_len)
+    {
+      in_used = tls->in_buf_used;
+      out_used = tls->out_buf_used;
+    }
+  else
+    {
+      debug_msg (3, "record buffers busy - resize deferred");
+      tls->wanted_buffer_len = len;
+      return 0;
+    }
+
+  tls->wanted_buffer_len = len;
+  in_ctr = recbuf_alloc (len);
+  if (!in_ctr)
+    return gpg_error_from_syserror ();
+  out_ctr = recbuf_alloc (len);
+  if (!out_ctr)
+    {
+      err = gpg_error_from_syserror ();
+      recbuf_free (in_ctr, len, 0);
+      return err;
+    }
+  tls->wanted_buffer_len = 0;
+
+  memcpy (in_ctr, tls->in_ctr, in_used);
+  tls->in_msg = in_ctr + (tls->in_msg - tls->in_ctr);
+  tls->in_hdr = in_ctr + 8;
+  tls->in_iv  = in_ctr + 13;
+  if (tls->in_offt)
+    tls->in_offt = in_ctr + (tls->in_offt - tls->in_ctr);
+  recbuf_free (tls->in_ctr, tls->buffer_len, tls->in_buf_used);
+  tls->in_ctr = in_ctr;
+  tls->in_buf_used = in_used;
+
+  memcpy (out_ctr, tls->out_ctr, out_used);
+  tls->out_msg = out_ctr + (tls->out_msg - tls->out_ctr);
+  tls->out_hdr = out_ctr + 8;
+  tls->out_iv  = out_ctr + 13;
+  recbuf_free (tls->out_ctr, tls->buffer_len, tls->out_buf_used);
+  tls->out_ctr = out_ctr;
+  tls->out_buf_used = out_used;
+
+  debug_msg (3, "record buffers resized to %zu bytes", len);
+  tls->buffer_len = len;
+  return 0;
+}
+
+
+/* Release the record buffers of TLS if the context has been created
+ * with NTBTLS_LAZYBUFFERS and nothing is pending in them; that is
+ * the handshake is complete, no partial record has been read or
+ * still needs to be written, and no application data or handshake
+ * message is waiting to be consumed.  A resize deferred by
+ * resize_record_buffers is carried out at the same point.  */
+static void
+release_idle_record_buffers (ntbtls_t tls)
+{
+  gpg_error_t err;
+
+  if (!tls->in_ctr)
+    return;
+
+  if (tls->state != TLS_HANDSHAKE_OVER || !record_buffers_idle (tls))
+    return;
+
+  if (!(tls->flags & NTBTLS_LAZYBUFFERS))
+    {
+      if (tls->wanted_buffer_len)
+        {
+          err = resize_record_buffers (tls, tls->wanted_buffer_len);
+          if (err)
+            debug_ret (1, "resize_record_buffers", err);
+        }
+      return;
+    }
+
+  memcpy (tls->saved_in_ctr, tls->in_ctr, 8);
+  tls->saved_in_msg_off = tls->in_msg - tls->in_ctr;
+  memcpy (tls->saved_out_ctr, tls->out_ctr, 8);
+  tls->saved_out_msg_off = tls->out_msg - tls->out_ctr;
+
+  recbuf_free (tls->in_ctr, tls->buffer_len, tls->in_buf_used);
+  recbuf_free (tls->out_ctr, tls->buffer_len, tls->out_buf_used);
+  tls->in_ctr = tls->in_hdr = tls->in_iv = tls->in_msg = NULL;
+  tls->out_ctr = tls->out_hdr = tls->out_iv = tls->out_msg = NULL;
+
+  if (tls->wanted_buffer_len)
+    {
+      /* The next allocation uses the new size.  */
+      tls->buffer_len = tls->wanted_buffer_len;
+      tls->wanted_buffer_len = 0;
+    }
+
+  debug_msg (3, "record buffers released");
+}
+
+
+
+
 /*
  * Create a new TLS context.  Valid values for FLAGS are:
  *
  *   NTBTLS_SERVER  - This endpoint is a server (default).
  *   NTBTLS_CLIENT  - This endpoint is a client.
+ *   NTBTLS_SAMETRHEAD - The context is only used by one thread.
+ *   NTBTLS_LAZYBUFFERS - Allocate the record buffers only while
+ *                      data is in transit and release them while
+ *                      the connection is idle.  A reader waiting
+ *                      for data does not hold them unless kernel
+ *                      TLS reads the records.
+ *   NTBTLS_FALSESTART - Let a client send application data before
+ *                      the server's Finished has been received
+ *                      (RFC 7918).
+ *   NTBTLS_KTLS    - Hand the record protection over to the Linux
+ *                      kernel after the handshake if possible.
  *
  * On success a context object is returned at R_TLS.  One error NULL
  * is stored at R_TLS and an error code is returned.
@@ -2698,12 +4801,12 @@ _ntbtls_new (ntbtls_t *r_tls, unsigned int flags)
 {
   gpg_error_t err;
   ntbtls_t tls;
-  int buffer_len = TLS_BUFFER_LEN;
 
   *r_tls = NULL;
 
   /* Note: NTBTLS_SERVER has value 0, thus we can't check for it. */
-  if ((flags & ~(NTBTLS_CLIENT|NTBTLS_SAMETRHEAD)))
+  if ((flags & ~(NTBTLS_CLIENT|NTBTLS_SAMETRHEAD|NTBTLS_LAZYBUFFERS
+                 |NTBTLS_FALSESTART|NTBTLS_KTLS)))
     return gpg_error (GPG_ERR_EINVAL);
 
   tls = calloc (1, sizeof *tls);
@@ -2722,14 +4825,16 @@ _ntbtls_new (ntbtls_t *r_tls, unsigned int flags)
     {
       tls->is_client = 1;
       tls->use_session_tickets = 1;
+      tls->use_encrypt_then_mac = 1;
     }
 
-  /* We only support TLS 1.2 and thus we set the list for the other
-     TLS versions to NULL.  */
+  /* We only support TLS 1.2 and 1.3 and thus we set the list for
+     the other TLS versions to NULL.  */
   tls->ciphersuite_list[TLS_MINOR_VERSION_0] = NULL;
   tls->ciphersuite_list[TLS_MINOR_VERSION_1] = NULL;
   tls->ciphersuite_list[TLS_MINOR_VERSION_2] = NULL;
   tls->ciphersuite_list[TLS_MINOR_VERSION_3] = _ntbtls_ciphersuite_list ();
+  tls->ciphersuite_list[TLS_MINOR_VERSION_4] = _ntbtls_ciphersuite_list ();
 
 
   tls->renego_max_records = TLS_RENEGO_MAX_RECORDS_DEFAULT;
@@ -2744,31 +4849,19 @@ _ntbtls_new (ntbtls_t *r_tls, unsigned int flags)
   /*     return (ret); */
   /*   } */
 
-  /*
-   * Prepare base structures
-   */
-  tls->in_ctr = malloc (buffer_len);
-  if (!tls->in_ctr)
-    {
-      err = gpg_error_from_syserror ();
-      goto leave;
-    }
-  tls->in_hdr = tls->in_ctr + 8;
-  tls->in_iv  = tls->in_ctr + 13;
-  tls->in_msg = tls->in_ctr + 13;
-
-  tls->out_ctr = malloc (buffer_len);
-  if (!tls->out_ctr)
+  /*
+   * Prepare base structures.  In lazy mode the record buffers are
+   * allocated on first use.
+   */
+  tls->buffer_len = TLS_BUFFER_LEN;
+  tls->saved_in_msg_off = 13;
+  tls->saved_out_msg_off = 13;
+  if (!(flags & NTBTLS_LAZYBUFFERS))
     {
-      err = gpg_error_from_syserror ();
-      goto leave;
+      err = acquire_record_buffers (tls);
+      if (err)
+        goto leave;
     }
-  tls->out_hdr = tls->out_ctr + 8;
-  tls->out_iv  = tls->out_ctr + 13;
-  tls->out_msg = tls->out_ctr + 13;
-
-  memset (tls->in_ctr, 0, buffer_len);
-  memset (tls->out_ctr, 0, buffer_len);
 
   tls->ticket_lifetime = TLS_DEFAULT_TICKET_LIFETIME;
 
@@ -2785,7 +4878,8 @@ _ntbtls_new (ntbtls_t *r_tls, unsigned int flags)
  leave:
   if (err)
     {
-      free (tls->in_ctr);
+      recbuf_free (tls->in_ctr, tls->buffer_len, tls->in_buf_used);
+      recbuf_free (tls->out_ctr, tls->buffer_len, tls->out_buf_used);
       free (tls);
     }
   else
@@ -2807,19 +4901,8 @@ _ntbtls_release (ntbtls_t tls)
   if (tls->magic != NTBTLS_CONTEXT_MAGIC)
     debug_bug ();
 
-  if (tls->out_ctr)
-    {
-      /* FIXME: At some points we are using a variable for the length.
-         Either do that always or use always this constant. */
-      wipememory (tls->out_ctr, TLS_BUFFER_LEN);
-      free (tls->out_ctr);
-    }
-
-  if (tls->in_ctr)
-    {
-      wipememory (tls->in_ctr, TLS_BUFFER_LEN);
-      free (tls->in_ctr);
-    }
+  recbuf_free (tls->out_ctr, tls->buffer_len, tls->out_buf_used);
+  recbuf_free (tls->in_ctr, tls->buffer_len, tls->in_buf_used);
 
   if (tls->compress_buf)
     {
@@ -2860,6 +4943,7 @@ _ntbtls_release (ntbtls_t tls)
     }
 
   free (tls->hostname);
+  free (tls->early_data);
 
   if (tls->psk)
     {
@@ -2953,7 +5037,9 @@ ssl_session_reset (ntbtls_t ssl)
 
   ssl->in_offt = NULL;
 
-  ssl->in_msg = ssl->in_ctr + 13;
+  if (ssl->in_ctr)
+    ssl->in_msg = ssl->in_ctr + 13;
+  ssl->saved_in_msg_off = 13;
   ssl->in_msgtype = 0;
   ssl->in_msglen = 0;
   ssl->in_left = 0;
@@ -2962,7 +5048,9 @@ ssl_session_reset (ntbtls_t ssl)
   ssl->nb_zero = 0;
   ssl->record_read = 0;
 
-  ssl->out_msg = ssl->out_ctr + 13;
+  if (ssl->out_ctr)
+    ssl->out_msg = ssl->out_ctr + 13;
+  ssl->saved_out_msg_off = 13;
   ssl->out_msgtype = 0;
   ssl->out_msglen = 0;
   ssl->out_left = 0;
@@ -2972,8 +5060,12 @@ ssl_session_reset (ntbtls_t ssl)
 
   ssl->renego_records_seen = 0;
 
-  memset (ssl->out_ctr, 0, TLS_BUFFER_LEN);
-  memset (ssl->in_ctr, 0, TLS_BUFFER_LEN);
+  memset (ssl->saved_out_ctr, 0, 8);
+  memset (ssl->saved_in_ctr, 0, 8);
+  if (ssl->out_ctr)
+    memset (ssl->out_ctr, 0, ssl->buffer_len);
+  if (ssl->in_ctr)
+    memset (ssl->in_ctr, 0, ssl->buffer_len);
 
   if (ssl->transform)
     {
@@ -3373,6 +5465,63 @@ _ntbtls_get_hostname (ntbtls_t tls)
 }
 
 
+/* Set DATA of length DATALEN to be sent as TLS 1.3 early data with
+ * the first flight of the handshake.  See ntbtls.h for details.  */
+gpg_error_t
+_ntbtls_set_early_data (ntbtls_t tls, const void *data, size_t datalen)
+{
+  unsigned char *buf = NULL;
+
+  if (!tls || (!data && datalen))
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (!tls->is_client || tls->state != TLS_HELLO_REQUEST)
+    return gpg_error (GPG_ERR_INV_STATE);
+
+  if (datalen)
+    {
+      buf = malloc (datalen);
+      if (!buf)
+        return gpg_error_from_syserror ();
+      memcpy (buf, data, datalen);
+    }
+
+  free (tls->early_data);
+  tls->early_data = buf;
+  tls->early_data_len = datalen;
+
+  return 0;
+}
+
+
+/* Ask the server to limit the length of records to LENGTH bytes
+ * using the max_fragment_length extension (RFC 6066).  See ntbtls.h
+ * for details.  */
+gpg_error_t
+_ntbtls_set_max_fragment_length (ntbtls_t tls, unsigned int length)
+{
+  unsigned char mfl_code;
+
+  if (!tls)
+    return gpg_error (GPG_ERR_INV_ARG);
+  if (!tls->is_client || tls->state != TLS_HELLO_REQUEST)
+    return gpg_error (GPG_ERR_INV_STATE);
+
+  if (!length)
+    mfl_code = TLS_MAX_FRAG_LEN_NONE;
+  else
+    {
+      for (mfl_code = 1; mfl_code < DIM (mfl_code_to_length); mfl_code++)
+        if (mfl_code_to_length[mfl_code] == length)
+          break;
+      if (mfl_code == DIM (mfl_code_to_length))
+        return gpg_error (GPG_ERR_INV_ARG);
+    }
+
+  tls->mfl_code = mfl_code;
+  return 0;
+}
+
+
 /* void */
 /* ssl_set_sni (ntbtls_t ssl, */
 /*              int (*f_sni) (void *, ntbtls_t, */
@@ -3439,21 +5588,6 @@ _ntbtls_get_hostname (ntbtls_t tls)
 /* } */
 
 
-int
-ssl_set_max_frag_len (ntbtls_t ssl, unsigned char mfl_code)
-{
-  if (mfl_code >= DIM(mfl_code_to_length)
-      || mfl_code_to_length[mfl_code] > TLS_MAX_CONTENT_LEN)
-    {
-      return gpg_error (GPG_ERR_INV_ARG);
-    }
-
-  ssl->mfl_code = mfl_code;
-
-  return (0);
-}
-
-
 int
 ssl_set_truncated_hmac (ntbtls_t ssl, int truncate)
 {
@@ -3574,29 +5708,80 @@ handshake_step (ntbtls_t tls)
 }
 
 
-/*
- * Perform the SSL handshake
- */
-gpg_error_t
-_ntbtls_handshake (ntbtls_t tls)
+/* Run the handshake steps until the handshake is complete.  If
+ * FALSE_START is set the loop stops as soon as application data may
+ * be sent; the remaining steps are then run by the next read.  The
+ * caller must have acquired the record buffers.  */
+static gpg_error_t
+handshake_loop (ntbtls_t tls, int false_start)
 {
   gpg_error_t err = 0;
 
   debug_msg (2, "handshake");
 
+  /* The handshake messages are built in place in OUT_MSG and not all
+   * bytes written there are seen by _ntbtls_write_record; for example
+   * if building a message fails half way.  Thus the entire outbound
+   * buffer is wiped when it is released.  */
+  if (tls->state != TLS_HANDSHAKE_OVER && tls->out_ctr)
+    tls->out_buf_used = tls->buffer_len;
+
   while (tls->state != TLS_HANDSHAKE_OVER)
     {
+      if (false_start && tls->handshake && tls->handshake->false_start)
+        {
+          debug_msg (2, "handshake: false start");
+          break;
+        }
       err = handshake_step (tls);
       if (err)
         break;
     }
 
+  /* Early data which has not been accepted by the server is now sent
+   * as ordinary application data.  */
+  if (!err && tls->early_data)
+    err = write_pending_early_data (tls);
+
+  /* If a maximum fragment length has been negotiated we shrink the
+     record buffers accordingly.  A failure is not fatal because the
+     current buffers are large enough; the resize is then tried again
+     by release_idle_record_buffers.  */
+  if (!err && tls->state == TLS_HANDSHAKE_OVER
+      && tls->session && tls->session->mfl_code != TLS_MAX_FRAG_LEN_NONE
+      && tls->session->compression == TLS_COMPRESS_NULL)
+    {
+      gpg_error_t err2 = resize_record_buffers
+        (tls, TLS_MFL_BUFFER_LEN (mfl_code_to_length[tls->session->mfl_code]));
+      if (err2)
+        debug_ret (1, "resize_record_buffers", err2);
+    }
+
   debug_msg (2, "handshake ready");
 
   return err;
 }
 
 
+/*
+ * Perform the SSL handshake
+ */
+gpg_error_t
+_ntbtls_handshake (ntbtls_t tls)
+{
+  gpg_error_t err;
+
+  err = acquire_record_buffers (tls);
+  if (err)
+    return err;
+
+  err = handshake_loop (tls, 0);
+
+  release_idle_record_buffers (tls);
+  return err;
+}
+
+
 /*
  * Write HelloRequest to request renegotiation on server
  */
@@ -3640,6 +5825,12 @@ start_renegotiation (ntbtls_t tls)
 
   debug_msg (2, "renegotiate");
 
+  /* Our handshake messages are not fragmented; thus switch back to
+     full sized record buffers.  */
+  err = resize_record_buffers (tls, TLS_BUFFER_LEN);
+  if (err)
+    return err;
+
   err = handshake_init (tls);
   if (err)
     return err;
@@ -3647,7 +5838,7 @@ start_renegotiation (ntbtls_t tls)
   tls->state = TLS_HELLO_REQUEST;
   tls->renegotiation = TLS_RENEGOTIATION;
 
-  err = _ntbtls_handshake (tls);
+  err = handshake_loop (tls, 0);
   if (err)
     {
       debug_ret (1, "handshake", err);
@@ -3714,6 +5905,10 @@ _ntbtls_close_notify (ntbtls_t tls)
 
   debug_msg (2, "write close_notify");
 
+  err = acquire_record_buffers (tls);
+  if (err)
+    return err;
+
   err = _ntbtls_flush_output (tls);
   if (err)
     {
@@ -3894,7 +6089,8 @@ _ntbtls_md_alg_from_hash (unsigned char hash)
  * Receive application data decrypted from the SSL layer
  */
 static gpg_error_t
-tls_read (ntbtls_t tls, unsigned char *buf, size_t len, size_t *nread)
+read_application_data (ntbtls_t tls, unsigned char *buf, size_t len,
+                       size_t *nread)
 {
   gpg_error_t err;
   size_t n;
@@ -3905,7 +6101,7 @@ tls_read (ntbtls_t tls, unsigned char *buf, size_t len, size_t *nread)
 
   if (tls->state != TLS_HANDSHAKE_OVER)
     {
-      err = _ntbtls_handshake (tls);
+      err = handshake_loop (tls, 0);
       if (err)
         {
           debug_ret (1, "handshake", err);
@@ -3925,6 +6121,26 @@ tls_read (ntbtls_t tls, unsigned char *buf, size_t len, size_t *nread)
           return err;
         }
 
+      /*
+       * TLS 1.3 has no renegotiation; handshake messages received
+       * after the handshake are processed here.
+       */
+      while (tls->minor_ver == TLS_MINOR_VERSION_4
+             && tls->in_msgtype == TLS_MSG_HANDSHAKE)
+        {
+          err = tls13_post_handshake_msg (tls);
+          if (!err)
+            err = _ntbtls_read_record (tls);
+          if (err)
+            {
+              if (gpg_err_code (err) == GPG_ERR_EOF)
+                return 0;
+
+              debug_ret (1, "read_record", err);
+              return err;
+            }
+        }
+
       if (!tls->in_msglen && tls->in_msgtype == TLS_MSG_APPLICATION_DATA)
         {
           /*
@@ -3952,7 +6168,9 @@ tls_read (ntbtls_t tls, unsigned char *buf, size_t len, size_t *nread)
               return gpg_error (GPG_ERR_UNEXPECTED_MSG);
             }
 
+          /* Note that the kernel TLS can't switch to new keys.  */
           if (tls->disable_renegotiation == TLS_RENEGOTIATION_DISABLED
+              || tls->ktls_tx || tls->ktls_rx
               || (tls->secure_renegotiation == TLS_LEGACY_RENEGOTIATION
                   && (tls->allow_legacy_renegotiation
                       == TLS_LEGACY_NO_RENEGOTIATION)))
@@ -4030,30 +6248,42 @@ tls_read (ntbtls_t tls, unsigned char *buf, size_t len, size_t *nread)
 }
 
 
-/*
- * Send application data to be encrypted by the TLS layer.
- */
 static gpg_error_t
-tls_write (ntbtls_t tls, const unsigned char *buf, size_t len, size_t *nwritten)
+tls_read (ntbtls_t tls, unsigned char *buf, size_t len, size_t *nread)
 {
   gpg_error_t err;
-  size_t n;
-  unsigned int max_len = TLS_MAX_CONTENT_LEN;
-
-  *nwritten = 0;
 
-  debug_msg (2, "tls write");
+  *nread = 0;
 
-  if (tls->state != TLS_HANDSHAKE_OVER)
+  /* The buffers are only released on an idle connection.  Wait for
+   * the next record before taking them again.  This is not possible
+   * if the kernel reads the records.  */
+  if (!tls->in_ctr && !tls->ktls_rx)
     {
-      err = _ntbtls_handshake (tls);
+      err = wait_for_record (tls);
+      if (gpg_err_code (err) == GPG_ERR_EOF)
+        return 0;  /* Same as in read_application_data.  */
       if (err)
-        {
-          debug_ret (1, "handshake", err);
-          return err;
-        }
+        return err;
     }
 
+  err = acquire_record_buffers (tls);
+  if (err)
+    return err;
+
+  err = read_application_data (tls, buf, len, nread);
+
+  release_idle_record_buffers (tls);
+  return err;
+}
+
+
+/* Return the maximum length of the plaintext of an outgoing record.  */
+static unsigned int
+max_fragment_len (ntbtls_t tls)
+{
+  unsigned int max_len;
+
   /*
    * Assume mfl_code is correct since it was checked when set
    */
@@ -4068,6 +6298,36 @@ tls_write (ntbtls_t tls, const unsigned char *buf, size_t len, size_t *nwritten)
       max_len = mfl_code_to_length[tls->session_out->mfl_code];
     }
 
+  return max_len;
+}
+
+
+/*
+ * Send application data to be encrypted by the TLS layer.
+ */
+static gpg_error_t
+write_application_data (ntbtls_t tls, const unsigned char *buf, size_t len,
+                        size_t *nwritten)
+{
+  gpg_error_t err;
+  size_t n;
+  unsigned int max_len;
+
+  *nwritten = 0;
+
+  debug_msg (2, "tls write");
+
+  if (tls->state != TLS_HANDSHAKE_OVER)
+    {
+      err = handshake_loop (tls, 1);
+      if (err)
+        {
+          debug_ret (1, "handshake", err);
+          return err;
+        }
+    }
+
+  max_len = max_fragment_len (tls);
   n = (len < max_len) ? len : max_len;
 
   if (tls->out_left)
@@ -4100,6 +6360,185 @@ tls_write (ntbtls_t tls, const unsigned char *buf, size_t len, size_t *nwritten)
 }
 
 
+/* Send the early data which could not be sent during the handshake
+ * and release it.  */
+static gpg_error_t
+write_pending_early_data (ntbtls_t tls)
+{
+  gpg_error_t err = 0;
+  unsigned char *data = tls->early_data;
+  size_t datalen = tls->early_data_len;
+  size_t off, n;
+
+  debug_msg (2, "sending early data after the handshake");
+
+  /* Detach the data first because write_application_data may run
+   * the handshake loop again.  */
+  tls->early_data = NULL;
+  tls->early_data_len = 0;
+
+  for (off = 0; off < datalen; off += n)
+    {
+      err = write_application_data (tls, data + off, datalen - off, &n);
+      if (err)
+        break;
+    }
+
+  free (data);
+  return err;
+}
+
+
+static gpg_error_t
+tls_write (ntbtls_t tls, const unsigned char *buf, size_t len, size_t *nwritten)
+{
+  gpg_error_t err;
+
+  *nwritten = 0;
+
+  err = acquire_record_buffers (tls);
+  if (err)
+    return err;
+
+  err = write_application_data (tls, buf, len, nwritten);
+
+  release_idle_record_buffers (tls);
+  return err;
+}
+
+
+/* Read up to SIZE bytes at OFFSET from the file FD into BUFFER.
+ * Returns the number of bytes read, 0 at EOF, or -1 on error.  */
+static gpgrt_ssize_t
+read_file_at (int fd, void *buffer, size_t size, gpgrt_off_t offset)
+{
+  gpgrt_ssize_t n;
+
+  do
+    {
+#ifdef HAVE_PREAD
+      n = pread (fd, buffer, size, offset);
+#else
+      if (lseek (fd, offset, SEEK_SET) == (off_t)(-1))
+        return -1;
+      n = read (fd, buffer, size);
+#endif
+    }
+  while (n < 0 && errno == EINTR);
+
+  return n;
+}
+
+
+/* Send LEN bytes of the file FD starting at OFFSET as application
+ * data.  The file is read directly into the record buffer where the
+ * data is encrypted in place; thus no copy to the plaintext stream is
+ * required.  If the records are protected by the kernel the file is
+ * handed over to sendfile.  The number of bytes sent is stored at
+ * R_NWRITTEN; this includes a record which has been built but is
+ * still pending in the record buffer due to a write error.  */
+gpg_error_t
+_ntbtls_send_file (ntbtls_t tls, int fd, gpgrt_off_t offset, size_t len,
+                   size_t *r_nwritten)
+{
+  gpg_error_t err;
+  unsigned int max_len;
+  gpgrt_ssize_t n;
+  size_t nwritten = 0;
+  size_t left;
+
+  if (r_nwritten)
+    *r_nwritten = 0;
+
+  if (!tls || fd < 0 || offset < 0)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  /* Data already written to the plaintext stream goes first.  */
+  if (tls->writefp && es_fflush (tls->writefp))
+    return gpg_error_from_syserror ();
+
+  err = acquire_record_buffers (tls);
+  if (err)
+    return err;
+
+  debug_msg (2, "tls send file");
+
+  if (tls->state != TLS_HANDSHAKE_OVER)
+    {
+      err = handshake_loop (tls, 1);
+      if (err)
+        {
+          debug_ret (1, "handshake", err);
+          goto leave;
+        }
+    }
+
+  if (tls->out_left)
+    {
+      err = _ntbtls_flush_output (tls);
+      if (err)
+        {
+          debug_ret (1, "flush_output", err);
+          goto leave;
+        }
+    }
+
+  if (tls->ktls_tx)
+    {
+      left = len;
+      err = _ntbtls_ktls_send_file (tls, fd, &offset, &len);
+      nwritten += left - len;
+      if (gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+        goto leave;
+      err = 0;  /* Send the remaining data as usual.  */
+    }
+
+  max_len = max_fragment_len (tls);
+  while (len)
+    {
+      n = read_file_at (fd, tls->out_msg, len < max_len? len : max_len,
+                        offset);
+      if (n < 0)
+        {
+          err = gpg_error_from_syserror ();
+          debug_ret (1, "read_file_at", err);
+          goto leave;
+        }
+      if (!n)
+        {
+          debug_msg (1, "file too short for send_file");
+          err = gpg_error (GPG_ERR_EOF);
+          goto leave;
+        }
+
+      tls->out_msglen = n;
+      tls->out_msgtype = TLS_MSG_APPLICATION_DATA;
+
+      err = _ntbtls_write_record (tls);
+      if (err)
+        {
+          /* The record is sent by the next flush.  */
+          if (tls->out_left)
+            nwritten += n;
+          debug_ret (1, "write_record", err);
+          goto leave;
+        }
+
+      offset += n;
+      len -= n;
+      nwritten += n;
+    }
+
+  debug_msg (2, "tls send file ready");
+
+ leave:
+  if (r_nwritten)
+    *r_nwritten = nwritten;
+  release_idle_record_buffers (tls);
+  return err;
+}
+
+
 
 /* Read handler for estream.  */
 static gpgrt_ssize_t
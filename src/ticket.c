@@ -0,0 +1,166 @@
+/* ticket.c - Cache of TLS 1.3 session tickets
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of NTBTLS
+ *
+ * NTBTLS is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * NTBTLS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntbtls-int.h"
+
+
+/* An item of the ticket cache.  */
+struct ticket_cache_item_s
+{
+  unsigned char key[32];  /* See _ntbtls_ticket_cache_take.  */
+  tls13_ticket_t ticket;  /* The ticket or NULL for an unused item.  */
+};
+
+/* The cache of session tickets.  This is disabled unless the
+ * application has called ntbtls_set_ticket_cache.  */
+static struct ticket_cache_item_s *ticket_cache;
+static unsigned int ticket_cache_size;
+
+/* The lock to protect the ticket cache.  */
+GPGRT_LOCK_DEFINE (ticket_cache_lock);
+
+
+
+/* Release TICKET.  */
+void
+_ntbtls_ticket_release (tls13_ticket_t ticket)
+{
+  if (!ticket)
+    return;
+
+  _ntbtls_x509_cert_release (ticket->peer_chain);
+  wipememory (ticket->psk, sizeof ticket->psk);
+  free (ticket);
+}
+
+
+/* Return true if TICKET has expired.  */
+static int
+ticket_expired (tls13_ticket_t ticket, time_t now)
+{
+  return now < ticket->received || now - ticket->received >= ticket->lifetime;
+}
+
+
+/* Enable the ticket cache with up to SIZE items.  A SIZE of 0
+ * disables the cache.  All items are flushed.  */
+gpg_error_t
+_ntbtls_set_ticket_cache (unsigned int size)
+{
+  struct ticket_cache_item_s *newcache = NULL;
+  struct ticket_cache_item_s *oldcache;
+  unsigned int oldsize, i;
+
+  if (size)
+    {
+      newcache = calloc (size, sizeof *newcache);
+      if (!newcache)
+        return gpg_error_from_syserror ();
+    }
+
+  gpgrt_lock_lock (&ticket_cache_lock);
+  oldcache = ticket_cache;
+  oldsize = ticket_cache_size;
+  ticket_cache = newcache;
+  ticket_cache_size = size;
+  gpgrt_lock_unlock (&ticket_cache_lock);
+
+  for (i=0; i < oldsize; i++)
+    _ntbtls_ticket_release (oldcache[i].ticket);
+  free (oldcache);
+
+  return 0;
+}
+
+
+/* Remove the ticket with KEY from the cache and return it.  KEY is a
+ * 32 byte hash over the hostname and the parameters of the
+ * connection.  A ticket is used only once (RFC 8446, C.4); thus the
+ * caller takes ownership.  Returns NULL if there is no valid ticket.  */
+tls13_ticket_t
+_ntbtls_ticket_cache_take (const unsigned char *key)
+{
+  tls13_ticket_t ticket = NULL;
+  unsigned int i;
+
+  if (!ticket_cache_size)
+    return NULL;
+
+  gpgrt_lock_lock (&ticket_cache_lock);
+  for (i=0; i < ticket_cache_size; i++)
+    if (ticket_cache[i].ticket && !memcmp (ticket_cache[i].key, key, 32))
+      {
+        ticket = ticket_cache[i].ticket;
+        ticket_cache[i].ticket = NULL;
+        break;
+      }
+  gpgrt_lock_unlock (&ticket_cache_lock);
+
+  if (ticket && ticket_expired (ticket, time (NULL)))
+    {
+      _ntbtls_ticket_release (ticket);
+      ticket = NULL;
+    }
+
+  return ticket;
+}
+
+
+/* Store TICKET under KEY in the cache.  The cache takes ownership of
+ * TICKET.  A former ticket with the same KEY is replaced; if the cache
+ * is full the oldest ticket is replaced.  */
+void
+_ntbtls_ticket_cache_put (const unsigned char *key, tls13_ticket_t ticket)
+{
+  unsigned int i, slot;
+  tls13_ticket_t oldticket = NULL;
+
+  if (!ticket)
+    return;
+
+  gpgrt_lock_lock (&ticket_cache_lock);
+  if (ticket_cache_size)
+    {
+      for (i=slot=0; i < ticket_cache_size; i++)
+        {
+          if (!ticket_cache[i].ticket
+              || !memcmp (ticket_cache[i].key, key, 32))
+            {
+              slot = i;
+              break;
+            }
+          if (ticket_cache[i].ticket->received
+              < ticket_cache[slot].ticket->received)
+            slot = i;
+        }
+      oldticket = ticket_cache[slot].ticket;
+      memcpy (ticket_cache[slot].key, key, 32);
+      ticket_cache[slot].ticket = ticket;
+    }
+  else
+    oldticket = ticket;  /* Cache is disabled.  */
+  gpgrt_lock_unlock (&ticket_cache_lock);
+
+  _ntbtls_ticket_release (oldticket);
+}
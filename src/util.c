@@ -24,6 +24,7 @@
 #include <ctype.h>
 
 #include "ntbtls-int.h"
+#include "ciphersuites.h"
 
 
 const char *
@@ -112,6 +113,7 @@ _ntbtls_check_version (const char *req_version)
     return compat_identification ();
 
   /* Initialize library.  */
+  _ntbtls_ciphersuite_init ();
 
   /* Check whether the caller only want the version number.  */
   if  (!req_version)
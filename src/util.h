@@ -107,7 +107,7 @@ buf24_to_size_t (const void *buffer)
 {
   const unsigned char *p = buffer;
 
-  return (((size_t)p[0] << 16) | (p[1] << 8) | p[1]);
+  return (((size_t)p[0] << 16) | (p[1] << 8) | p[2]);
 }
 
 static inline uint32_t
@@ -45,6 +45,27 @@ ntbtls_set_log_handler (ntbtls_log_handler_t cb, void *cb_value)
 }
 
 
+gpg_error_t
+ntbtls_ecdh_pool_fill (const char *curve, unsigned int count)
+{
+  return _ntbtls_ecdh_pool_fill (curve, count);
+}
+
+
+gpg_error_t
+ntbtls_set_chain_cache (unsigned int size, unsigned int ttl)
+{
+  return _ntbtls_x509_set_chain_cache (size, ttl);
+}
+
+
+gpg_error_t
+ntbtls_set_ticket_cache (unsigned int size)
+{
+  return _ntbtls_set_ticket_cache (size);
+}
+
+
 gpg_error_t
 ntbtls_new (ntbtls_t *r_tls, unsigned int flags)
 {
@@ -90,6 +111,14 @@ ntbtls_get_stream (ntbtls_t tls,
 }
 
 
+gpg_error_t
+ntbtls_send_file (ntbtls_t tls, int fd, gpgrt_off_t offset, size_t len,
+                  size_t *r_nwritten)
+{
+  return _ntbtls_send_file (tls, fd, offset, len, r_nwritten);
+}
+
+
 gpg_error_t
 ntbtls_set_hostname (ntbtls_t tls, const char *hostname)
 {
@@ -104,6 +133,20 @@ ntbtls_get_hostname (ntbtls_t tls)
 }
 
 
+gpg_error_t
+ntbtls_set_early_data (ntbtls_t tls, const void *data, size_t datalen)
+{
+  return _ntbtls_set_early_data (tls, data, datalen);
+}
+
+
+gpg_error_t
+ntbtls_set_max_fragment_length (ntbtls_t tls, unsigned int length)
+{
+  return _ntbtls_set_max_fragment_length (tls, length);
+}
+
+
 gpg_error_t
 ntbtls_handshake (ntbtls_t tls)
 {
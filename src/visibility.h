@@ -49,12 +49,18 @@ MARK_VISIBLE (_ntbtls_check_context)
 MARK_VISIBLE (ntbtls_release)
 MARK_VISIBLE (ntbtls_set_transport)
 MARK_VISIBLE (ntbtls_get_stream)
+MARK_VISIBLE (ntbtls_send_file)
 MARK_VISIBLE (ntbtls_set_hostname)
 MARK_VISIBLE (ntbtls_get_hostname)
 MARK_VISIBLE (ntbtls_handshake)
 MARK_VISIBLE (ntbtls_set_verify_cb)
 MARK_VISIBLE (ntbtls_x509_get_peer_cert)
 MARK_VISIBLE (ntbtls_get_last_alert)
+MARK_VISIBLE (ntbtls_ecdh_pool_fill)
+MARK_VISIBLE (ntbtls_set_chain_cache)
+MARK_VISIBLE (ntbtls_set_ticket_cache)
+MARK_VISIBLE (ntbtls_set_early_data)
+MARK_VISIBLE (ntbtls_set_max_fragment_length)
 
 
 #undef MARK_VISIBLE
@@ -71,12 +77,18 @@ MARK_VISIBLE (ntbtls_get_last_alert)
 #define ntbtls_released              _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_set_transport         _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_get_stream            _ntbtls_USE_THE_UNDERSCORED_FUNCTION
+#define ntbtls_send_file             _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_set_hostname          _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_get_hostname          _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_handshake             _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_set_verify_cb         _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_x509_get_peer_cert    _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 #define ntbtls_get_last_alert        _ntbtls_USE_THE_UNDERSCORED_FUNCTION
+#define ntbtls_ecdh_pool_fill        _ntbtls_USE_THE_UNDERSCORED_FUNCTION
+#define ntbtls_set_chain_cache       _ntbtls_USE_THE_UNDERSCORED_FUNCTION
+#define ntbtls_set_ticket_cache      _ntbtls_USE_THE_UNDERSCORED_FUNCTION
+#define ntbtls_set_early_data        _ntbtls_USE_THE_UNDERSCORED_FUNCTION
+#define ntbtls_set_max_fragment_length _ntbtls_USE_THE_UNDERSCORED_FUNCTION
 
 #endif /*!_NTBTLS_INCLUDED_BY_VISIBILITY_C*/
 #endif /*NTBTLS_VISIBILITY_H*/
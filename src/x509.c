@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <ksba.h>
 
 #include "ntbtls-int.h"
@@ -32,10 +33,37 @@
 struct x509_cert_s
 {
   x509_cert_t next;
+  unsigned int refcount; /* Reference counter; only used by the first
+                            node of a chain.  */
+  int shared;            /* Set if another reference to the chain has
+                            ever been taken; only used by the first
+                            node of a chain.  */
   ksba_cert_t crt;       /* The actual certificate object.  */
+  gcry_sexp_t pk;        /* The public key of CRT or NULL if not yet
+                            needed.  */
 };
 
 
+/* An item of the cache of verified peer chains.  */
+struct chain_cache_item_s
+{
+  unsigned char key[32]; /* See _ntbtls_x509_chain_cache_get.  */
+  time_t expires;        /* The item is valid until this time.  */
+  x509_cert_t chain;     /* The chain or NULL for an unused item.  */
+};
+
+/* The cache of verified peer chains.  This is disabled unless the
+ * application has called ntbtls_set_chain_cache.  */
+static struct chain_cache_item_s *chain_cache;
+static unsigned int chain_cache_size;
+static unsigned int chain_cache_ttl;
+
+/* The lock to protect the chain cache and the reference counters of
+ * shared chains.  A chain which has never been shared has only one
+ * owner and thus needs no locking.  */
+GPGRT_LOCK_DEFINE (chain_cache_lock);
+
+
 /* The object tostore a private key.  */
 struct x509_privkey_s
 {
@@ -274,6 +302,7 @@ _ntbtls_x509_cert_new (x509_cert_t *r_cert)
   cert = calloc (1, sizeof *cert);
   if (!cert)
     return gpg_error_from_syserror ();
+  cert->refcount = 1;
 
   *r_cert = cert;
 
@@ -281,14 +310,41 @@ _ntbtls_x509_cert_new (x509_cert_t *r_cert)
 }
 
 
+/* Take another reference to the X.509 certificate chain CERT.  */
+void
+_ntbtls_x509_cert_ref (x509_cert_t cert)
+{
+  if (!cert)
+    return;
+
+  gpgrt_lock_lock (&chain_cache_lock);
+  cert->refcount++;
+  cert->shared = 1;
+  gpgrt_lock_unlock (&chain_cache_lock);
+}
+
+
 /* Release an X.509 certificate chain.  */
 void
 _ntbtls_x509_cert_release (x509_cert_t cert)
 {
+  if (!cert)
+    return;
+
+  /* A chain which has never been shared has just one reference.  */
+  if (cert->shared)
+    {
+      gpgrt_lock_lock (&chain_cache_lock);
+      if (--cert->refcount)
+        cert = NULL;  /* Still in use.  */
+      gpgrt_lock_unlock (&chain_cache_lock);
+    }
+
   while (cert)
     {
       x509_cert_t next = cert->next;
       ksba_cert_release (cert->crt);
+      gcry_sexp_release (cert->pk);
       free (cert);
       cert = next;
     }
@@ -475,9 +531,121 @@ _ntbtls_x509_get_peer_cert (ntbtls_t tls, int idx)
 }
 
 
+/* Enable the cache of verified peer chains with up to SIZE items
+ * which are valid for TTL seconds.  A SIZE or TTL of 0 disables the
+ * cache.  All items are flushed.  */
+gpg_error_t
+_ntbtls_x509_set_chain_cache (unsigned int size, unsigned int ttl)
+{
+  struct chain_cache_item_s *newcache = NULL;
+  struct chain_cache_item_s *oldcache;
+  unsigned int oldsize, i;
+
+  if (!ttl)
+    size = 0;
+  if (size)
+    {
+      newcache = calloc (size, sizeof *newcache);
+      if (!newcache)
+        return gpg_error_from_syserror ();
+    }
+
+  gpgrt_lock_lock (&chain_cache_lock);
+  oldcache = chain_cache;
+  oldsize = chain_cache_size;
+  chain_cache = newcache;
+  chain_cache_size = size;
+  chain_cache_ttl = ttl;
+  gpgrt_lock_unlock (&chain_cache_lock);
+
+  for (i=0; i < oldsize; i++)
+    _ntbtls_x509_cert_release (oldcache[i].chain);
+  free (oldcache);
+
+  return 0;
+}
+
+
+/* Look up the chain with KEY in the cache of verified chains.  KEY is
+ * a 32 byte hash over the DER encoded chain and all parameters which
+ * were used to verify it.  On a hit a new reference to the chain is
+ * stored at R_CHAIN and true is returned.  */
+int
+_ntbtls_x509_chain_cache_get (const unsigned char *key, x509_cert_t *r_chain)
+{
+  time_t now;
+  unsigned int i;
+
+  *r_chain = NULL;
+
+  if (!chain_cache_size)
+    return 0;
+
+  now = time (NULL);
+
+  gpgrt_lock_lock (&chain_cache_lock);
+  for (i=0; i < chain_cache_size; i++)
+    if (chain_cache[i].chain && !memcmp (chain_cache[i].key, key, 32))
+      {
+        if (chain_cache[i].expires > now)
+          {
+            *r_chain = chain_cache[i].chain;
+            (*r_chain)->refcount++;
+          }
+        break;
+      }
+  gpgrt_lock_unlock (&chain_cache_lock);
+
+  return !!*r_chain;
+}
+
+
+/* Store the verified CHAIN under KEY in the cache.  If the cache is
+ * full the oldest item is replaced.  */
+void
+_ntbtls_x509_chain_cache_put (const unsigned char *key, x509_cert_t chain)
+{
+  time_t now;
+  unsigned int i, slot;
+  x509_cert_t oldchain = NULL;
+
+  if (!chain_cache_size || !chain)
+    return;
+
+  now = time (NULL);
+
+  gpgrt_lock_lock (&chain_cache_lock);
+  if (chain_cache_size)
+    {
+      for (i=slot=0; i < chain_cache_size; i++)
+        {
+          if (!chain_cache[i].chain
+              || !memcmp (chain_cache[i].key, key, 32))
+            {
+              slot = i;
+              break;
+            }
+          if (chain_cache[i].expires < chain_cache[slot].expires)
+            slot = i;
+        }
+      oldchain = chain_cache[slot].chain;
+      memcpy (chain_cache[slot].key, key, 32);
+      chain_cache[slot].expires = now + chain_cache_ttl;
+      chain_cache[slot].chain = chain;
+      chain->refcount++;
+      chain->shared = 1;
+    }
+  gpgrt_lock_unlock (&chain_cache_lock);
+
+  _ntbtls_x509_cert_release (oldchain);
+}
+
+
 /* Return the public key from the certificate with index IDX in CERT
-   and store it as an S-expression at R_PK.  On error return an error
-   code and store NULL at R_PK.  */
+   and store it as an S-expression at R_PK.  The S-expression is
+   built only once and kept with the certificate; thus the caller must
+   not release it and may use it only as long as CERT is valid.  On
+   error return an error code and store NULL at R_PK.  */
 gpg_error_t
 _ntbtls_x509_get_pk (x509_cert_t cert, int idx, gcry_sexp_t *r_pk)
 {
@@ -485,6 +653,7 @@ _ntbtls_x509_get_pk (x509_cert_t cert, int idx, gcry_sexp_t *r_pk)
   ksba_sexp_t pk;
   size_t pklen;
   gcry_sexp_t s_pk;
+  int shared;
 
   if (!r_pk)
     return gpg_error (GPG_ERR_INV_ARG);
@@ -492,11 +661,25 @@ _ntbtls_x509_get_pk (x509_cert_t cert, int idx, gcry_sexp_t *r_pk)
 
   if (idx < 0)
     gpg_error (GPG_ERR_INV_INDEX);
+  shared = cert && cert->shared;
   for (; cert && idx; cert = cert->next, idx--)
     ;
   if (!cert)
     return gpg_error (GPG_ERR_NO_DATA);
 
+  /* If the chain is shared, for example via the chain cache, we need
+   * to take the lock.  */
+  if (shared)
+    gpgrt_lock_lock (&chain_cache_lock);
+  s_pk = cert->pk;
+  if (shared)
+    gpgrt_lock_unlock (&chain_cache_lock);
+  if (s_pk)
+    {
+      *r_pk = s_pk;
+      return 0;
+    }
+
   pk = ksba_cert_get_public_key (cert->crt);
   pklen = gcry_sexp_canon_len (pk, 0, NULL, NULL);
   if (!pklen)
@@ -513,6 +696,19 @@ _ntbtls_x509_get_pk (x509_cert_t cert, int idx, gcry_sexp_t *r_pk)
       debug_ret (1, "gcry_sexp_scan", err);
       return err;
     }
+
+  if (shared)
+    gpgrt_lock_lock (&chain_cache_lock);
+  if (cert->pk)  /* Another thread was faster.  */
+    {
+      gcry_sexp_release (s_pk);
+      s_pk = cert->pk;
+    }
+  else
+    cert->pk = s_pk;
+  if (shared)
+    gpgrt_lock_unlock (&chain_cache_lock);
+
   *r_pk = s_pk;
   return 0;
 }